@@ -0,0 +1,39 @@
+/*
+ * jconfig.h for jpeg.lib (IJG libjpeg 8c, built for x64 with Microsoft
+ * Visual C++ from jconfig.vc).
+ *
+ * jpeglib.h, jmorecfg.h and jerror.h next to this file come from
+ * libjpeg-turbo 2.1.5, whose headers reproduce the libjpeg 8 API and ABI
+ * when JPEG_LIB_VERSION is 80. The settings below are those of jconfig.vc,
+ * so the structures match the library: jpeg_CreateDecompress() in jpeg.lib
+ * checks for version 80 and a 624-byte jpeg_decompress_struct (568 bytes
+ * for jpeg_compress_struct), which is what these headers give on x64.
+ */
+
+/* IJG libjpeg 8c */
+#define JPEG_LIB_VERSION  80
+
+/* 8-bit samples, the only depth jpeg.lib was built for */
+#define BITS_IN_JSAMPLE  8
+
+/* jpeg.lib includes jcarith.c and jdarith.c */
+#define C_ARITH_CODING_SUPPORTED 1
+#define D_ARITH_CODING_SUPPORTED 1
+
+#define HAVE_PROTOTYPES
+#define HAVE_UNSIGNED_CHAR
+#define HAVE_UNSIGNED_SHORT
+#undef CHAR_IS_UNSIGNED
+#define HAVE_STDDEF_H
+#define HAVE_STDLIB_H
+#undef NEED_BSD_STRINGS
+#undef NEED_SYS_TYPES_H
+#undef NEED_FAR_POINTERS	/* we presume a 32-bit flat memory model */
+#undef NEED_SHORT_EXTERNAL_NAMES
+#undef INCOMPLETE_TYPES_BROKEN
+
+/* Define "boolean" as unsigned char, not int, per Windows custom */
+#ifndef __RPCNDR_H__		/* don't conflict if rpcndr.h already read */
+typedef unsigned char boolean;
+#endif
+#define HAVE_BOOLEAN		/* prevent jmorecfg.h from redefining it */
@@ -0,0 +1,128 @@
+extern "C" {
+  #include "puzzle_common.h"
+  #include "puzzle.h"
+  #include "puzzle_p.h"
+}
+
+#include <vector>
+
+/*******************************************************
+*
+*	kernel-test: checks that every SIMD distance kernel of
+*	libpuzzle/vector_ops.c the CPU supports gives the same
+*	sums as the scalar one, over random cvec values.
+*
+*	usage: kernel-test [seed]
+*
+********************************************************/
+
+using namespace std;
+
+typedef struct KernelLevel_ {
+	const char *name;
+	unsigned int features;
+} KernelLevel;
+
+static const KernelLevel levels[] = {
+	{ "sse4.1", PUZZLE_CPU_SSE41 },
+	{ "avx2", PUZZLE_CPU_AVX2 },
+	{ "avx512bw", PUZZLE_CPU_AVX512BW }
+};
+
+// lengths off every vector width, plus the longest chunk a kernel gets
+static const size_t longLengths[] = {
+	1023, 1025, 4095, 4097, 65535, 65599, ((size_t)1U << 20) - 1U
+};
+
+static unsigned long long rngState;
+
+static unsigned int nextRandom(void)
+{
+	rngState = rngState * 6364136223846793005ULL + 1442695040888963407ULL;
+	return (unsigned int)(rngState >> 33);
+}
+
+// values in [-2, 2], or only their extremes to stress the text fix
+static void fillRandom(vector<signed char> &vec, size_t n, bool extremes)
+{
+	static const signed char pick[] = { -2, 0, 2 };
+
+	for (size_t i = 0; i < n; i++) {
+		if (extremes)
+			vec[i] = pick[nextRandom() % 3U];
+		else
+			vec[i] = (signed char)((int)(nextRandom() % 5U) - 2);
+	}
+}
+
+// runs one case on every kernel, at an odd offset to break the alignment
+static unsigned int checkCase(const PuzzleDistanceFn *kernels, size_t nkernels,
+	const vector<signed char> &vec1, const vector<signed char> &vec2,
+	size_t offset, size_t size, int fix_for_texts)
+{
+	unsigned long expected[3] = { 0UL, 0UL, 0UL };
+	unsigned int failures = 0;
+
+	kernels[0](&vec1[offset], &vec2[offset], size, fix_for_texts, expected);
+	for (size_t k = 1; k < nkernels; k++) {
+		unsigned long sums[3] = { 0UL, 0UL, 0UL };
+
+		kernels[k](&vec1[offset], &vec2[offset], size, fix_for_texts, sums);
+		if (sums[0] != expected[0] || sums[1] != expected[1] ||
+			sums[2] != expected[2]) {
+			printf("MISMATCH %s: size %lu offset %lu fix %d: "
+				"%lu %lu %lu instead of %lu %lu %lu\n",
+				levels[k - 1].name, (unsigned long)size,
+				(unsigned long)offset, fix_for_texts,
+				sums[0], sums[1], sums[2],
+				expected[0], expected[1], expected[2]);
+			failures++;
+		}
+	}
+	return failures;
+}
+
+int main(int argc, char *argv[])
+{
+	const unsigned int features = puzzle_cpu_features();
+	PuzzleDistanceFn kernels[1 + sizeof levels / sizeof levels[0]];
+	size_t nkernels = 0;
+	size_t maxSize = longLengths[sizeof longLengths / sizeof longLengths[0] - 1];
+	vector<signed char> vec1(maxSize + 3U), vec2(maxSize + 3U);
+	unsigned long cases = 0;
+	unsigned int failures = 0;
+
+	rngState = argc > 1 ? strtoull(argv[1], NULL, 10) : 1ULL;
+	kernels[nkernels++] = puzzle_vector_distance_kernel_for(0U);
+	for (size_t l = 0; l < sizeof levels / sizeof levels[0]; l++) {
+		if ((features & levels[l].features) == 0U) {
+			printf("%s: not supported by this CPU, skipped\n", levels[l].name);
+			break;
+		}
+		kernels[nkernels++] = puzzle_vector_distance_kernel_for(levels[l].features);
+	}
+	for (int extremes = 0; extremes < 2; extremes++) {
+		for (int fix_for_texts = 0; fix_for_texts < 2; fix_for_texts++) {
+			// every length up to a few AVX-512 registers
+			for (size_t size = 1; size <= 300; size++) {
+				fillRandom(vec1, size + 2U, extremes != 0);
+				fillRandom(vec2, size + 2U, extremes != 0);
+				failures += checkCase(kernels, nkernels, vec1, vec2,
+					size % 3U, size, fix_for_texts);
+				cases++;
+			}
+			for (size_t l = 0; l < sizeof longLengths / sizeof longLengths[0]; l++) {
+				fillRandom(vec1, longLengths[l] + 2U, extremes != 0);
+				fillRandom(vec2, longLengths[l] + 2U, extremes != 0);
+				failures += checkCase(kernels, nkernels, vec1, vec2,
+					l % 3U, longLengths[l], fix_for_texts);
+				cases++;
+			}
+		}
+	}
+	for (size_t k = 1; k < nkernels; k++)
+		printf("%s: checked against scalar\n", levels[k - 1].name);
+	printf("%lu cases, %u mismatches\n", cases, failures);
+
+	return failures == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+}
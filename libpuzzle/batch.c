@@ -0,0 +1,214 @@
+#include "puzzle_common.h"
+#include "puzzle_p.h"
+#include "puzzle.h"
+#include "globals.h"
+#include <sys/stat.h>
+#include <cilk/cilk.h>
+#include <cilk/cilk_api.h>
+
+typedef struct PuzzleBatchSlot_ {
+	volatile long busy;
+	volatile size_t retained;
+	PuzzleScratch scratch;
+} PuzzleBatchSlot;
+
+typedef struct PuzzleBatchItem_ {
+	size_t size;
+	size_t index;
+} PuzzleBatchItem;
+
+void puzzle_init_batch_options(PuzzleBatchOptions * const options)
+{
+	options->memory_budget = (size_t)0U;
+	options->largest_first = 1;
+}
+
+static size_t puzzle_batch_input_size(const PuzzleBatchInput * const input)
+{
+	struct stat st;
+
+	if (input->file == NULL) {
+		return input->len;
+	}
+	if (stat(input->file, &st) != 0 || st.st_size <= 0) {
+		return (size_t)0U;
+	}
+	return (size_t)st.st_size;
+}
+
+static int puzzle_batch_cmp(const void * const a_, const void * const b_)
+{
+	const PuzzleBatchItem * const a = a_;
+	const PuzzleBatchItem * const b = b_;
+
+	if (a->size != b->size) {
+		return a->size > b->size ? -1 : 1;
+	}
+	return a->index < b->index ? -1 : a->index > b->index;
+}
+
+/*
+ * Any free slot will do, starting from the worker's own to keep arenas
+ * warm. A strand can resume on another worker after libpuzzle's own
+ * cilk_for, so slots are claimed, never assumed; when they are all
+ * taken, the image simply goes through the heap.
+ */
+static PuzzleBatchSlot *puzzle_batch_claim(PuzzleBatchSlot * const slots,
+	const unsigned int nslots)
+{
+	unsigned int first;
+	unsigned int i;
+
+	first = (unsigned int)__cilkrts_get_worker_number() % nslots;
+	i = first;
+	do {
+		if (slots[i].busy == 0L && PUZZLE_CAS_LONG(&slots[i].busy, 0L, 1L)) {
+			return &slots[i];
+		}
+		i = (i + 1U) % nslots;
+	} while (i != first);
+
+	return NULL;
+}
+
+/*
+ * What the arenas keep between images, as last published by their
+ * owners; an arena at its peak is reallocated to that size on next use.
+ */
+static size_t puzzle_batch_retained(PuzzleBatchSlot * const slot,
+	PuzzleBatchSlot * const slots,
+	const unsigned int nslots)
+{
+	size_t retained = (size_t)0U;
+	unsigned int i;
+
+	slot->retained = MAX(slot->scratch.sizeof_arena, slot->scratch.peak);
+	for (i = 0U; i < nslots; i++) {
+		retained += slots[i].retained;
+	}
+	return retained;
+}
+
+static int puzzle_batch_fill(PuzzleContext * const context,
+	const PuzzleBatchInput * const input,
+	PuzzleCvec * const cvec,
+	PuzzleScratch * const scratch)
+{
+	PuzzleCvec tmp;
+	int ret;
+
+	if (scratch == NULL) {
+		if (input->file != NULL) {
+			return puzzle_fill_cvec_from_file(context, cvec, input->file);
+		}
+		return puzzle_fill_cvec_from_memory(context, cvec,
+			input->buf, input->len);
+	}
+	if (input->file != NULL) {
+		ret = puzzle_fill_cvec_from_file_scratch(context, &tmp,
+			input->file, scratch);
+	}
+	else {
+		ret = puzzle_fill_cvec_from_memory_scratch(context, &tmp,
+			input->buf, input->len, scratch);
+	}
+	if (ret != 0) {
+		return ret;
+	}
+	// the result outlives the arena, so it gets a buffer of its own
+	if ((cvec->vec = malloc(tmp.sizeof_vec)) == NULL) {
+		return -1;
+	}
+	memcpy(cvec->vec, tmp.vec, tmp.sizeof_vec);
+	cvec->sizeof_vec = tmp.sizeof_vec;
+
+	return 0;
+}
+
+/*
+ * Computes the cvecs of n files or buffers in parallel. Every cvec is
+ * initialized and must be released with puzzle_free_cvec(); status[i]
+ * gets what puzzle_fill_cvec_from_file() would have returned for it.
+ * Larger inputs start first, so a big image found late does not keep a
+ * single worker busy while the others are idle. Each image borrows one
+ * of a few scratch arenas, and an arena is dropped after its image when
+ * all arenas together keep more than the memory budget.
+ * Returns -1 if the batch could not be started at all, 0 otherwise.
+ */
+int puzzle_fill_cvecs_batch(PuzzleContext * const context,
+	const PuzzleBatchInput * const inputs,
+	const size_t n,
+	PuzzleCvec * const cvecs,
+	int * const status,
+	const PuzzleBatchOptions * const options)
+{
+	PuzzleBatchOptions defaults;
+	const PuzzleBatchOptions *opts = options;
+	PuzzleBatchItem *items;
+	PuzzleBatchSlot *slots;
+	unsigned int nslots;
+	size_t i;
+
+	if (context->magic != PUZZLE_CONTEXT_MAGIC) {
+		puzzle_err_bug(__FILE__, __LINE__);
+	}
+	if (opts == NULL) {
+		puzzle_init_batch_options(&defaults);
+		opts = &defaults;
+	}
+	for (i = (size_t)0U; i < n; i++) {
+		puzzle_init_cvec(context, &cvecs[i]);
+		status[i] = -1;
+	}
+	if (n <= (size_t)0U) {
+		return 0;
+	}
+	// a strand can be suspended in libpuzzle's cilk_for, leave some slack
+	nslots = 2U * (unsigned int)__cilkrts_get_nworkers();
+	if (SIZE_MAX / sizeof *items < n ||
+		(items = malloc(n * sizeof *items)) == NULL) {
+		return -1;
+	}
+	if ((slots = calloc((size_t)nslots, sizeof *slots)) == NULL) {
+		free(items);
+		return -1;
+	}
+	for (i = (size_t)0U; i < n; i++) {
+		items[i].index = i;
+		items[i].size = opts->largest_first != 0 ?
+			puzzle_batch_input_size(&inputs[i]) : (size_t)0U;
+	}
+	if (opts->largest_first != 0) {
+		qsort(items, n, sizeof *items, puzzle_batch_cmp);
+	}
+	for (i = (size_t)0U; i < (size_t)nslots; i++) {
+		puzzle_init_scratch(&slots[i].scratch);
+	}
+
+	//Paralized for loop (one task for each input, largest first)
+	#pragma cilk grainsize = 1
+	cilk_for(size_t item = 0U; item < n; item++)
+	{
+		const size_t index = items[item].index;
+		PuzzleBatchSlot * const slot = puzzle_batch_claim(slots, nslots);
+
+		status[index] = puzzle_batch_fill(context, &inputs[index],
+			&cvecs[index], slot == NULL ? NULL : &slot->scratch);
+		if (slot != NULL) {
+			if (opts->memory_budget > (size_t)0U &&
+				puzzle_batch_retained(slot, slots, nslots) >
+				opts->memory_budget) {
+				puzzle_free_scratch(&slot->scratch);
+				slot->retained = (size_t)0U;
+			}
+			PUZZLE_RELEASE_LONG(&slot->busy);
+		}
+	}
+	for (i = (size_t)0U; i < (size_t)nslots; i++) {
+		puzzle_free_scratch(&slots[i].scratch);
+	}
+	free(slots);
+	free(items);
+
+	return 0;
+}
@@ -0,0 +1,276 @@
+#include "puzzle_common.h"
+#include "puzzle_p.h"
+#include "puzzle.h"
+#include "globals.h"
+
+#define PUZZLE_BLOCK_CACHE_SLOTS 64U
+#define PUZZLE_BLOCK_CACHE_PROBES 4U
+
+/*
+ * A slot is rewritten in place under a sequence number: a writer claims it
+ * by moving seq from even to odd with a compare-and-swap and publishes it
+ * by making it even again, and readers retry elsewhere when seq is odd or
+ * changed while they were copying. The blocks array is allocated the first
+ * time the slot is written and never moved, so a racing reader may copy
+ * stale blocks but never freed memory.
+ */
+typedef struct PuzzleBlockSlot_ {
+	volatile long seq;
+	unsigned int width;
+	unsigned int height;
+	unsigned int lambdas;
+	double p_ratio;
+	size_t capacity;
+	PuzzleBlock *blocks;
+} PuzzleBlockSlot;
+
+struct PuzzleBlockCache_ {
+	PuzzleBlockSlot slots[PUZZLE_BLOCK_CACHE_SLOTS];
+	volatile unsigned long long hits;
+	volatile unsigned long long misses;
+};
+
+#ifdef _MSC_VER
+static void puzzle_atomic_inc(volatile unsigned long long * const counter)
+{
+	__int64 value;
+
+	do {
+		value = (__int64)*counter;
+	} while (_InterlockedCompareExchange64((volatile __int64 *)counter,
+		value + 1, value) != value);
+}
+#else
+static void puzzle_atomic_inc(volatile unsigned long long * const counter)
+{
+	(void)__sync_fetch_and_add(counter, 1ULL);
+}
+#endif
+
+/*
+ * Position and size of the p x p sample square of every block of the
+ * lambdas x lambdas grid, laid out like the levels of PUZZLE_AVGLVL().
+ */
+void puzzle_compute_blocks(PuzzleContext * const context,
+	PuzzleBlock * const blocks,
+	const unsigned int view_width,
+	const unsigned int view_height,
+	const unsigned int lambdas)
+{
+	double width = (double)view_width;
+	double height = (double)view_height;
+	double xshift, yshift;
+	double x, y;
+	unsigned int p;
+	unsigned int lx, ly;
+	unsigned int xd, yd;
+	unsigned int px, py;
+	unsigned int lwidth, lheight;
+	PuzzleBlock *block;
+
+	xshift = (width -
+		(width * (double)lambdas / (double)SUCC(lambdas))) / 2.0;
+	yshift = (height -
+		(height * (double)lambdas / (double)SUCC(lambdas))) / 2.0;
+	p = (unsigned int)round(MIN(width, height) /
+		(SUCC(lambdas) * context->puzzle_p_ratio));
+	if (p < PUZZLE_MIN_P) {
+		p = PUZZLE_MIN_P;
+	}
+	lx = 0U;
+	do {
+		ly = 0U;
+		do {
+			x = xshift + (double)lx * PRED(width) / SUCC(lambdas);
+			y = yshift + (double)ly * PRED(height) / SUCC(lambdas);
+			lwidth = (unsigned int)round
+				(xshift + (double)SUCC(lx) * PRED(width) /
+				(double)SUCC(lambdas) - x);
+			lheight = (unsigned int)round
+				(yshift + (double)SUCC(ly) * PRED(height) /
+				(double)SUCC(lambdas) - y);
+			if (p < lwidth) {
+				xd = (unsigned int)round(x + (lwidth - p) / 2.0);
+			}
+			else {
+				xd = (unsigned int)round(x);
+			}
+			if (p < lheight) {
+				yd = (unsigned int)round(y + (lheight - p) / 2.0);
+			}
+			else {
+				yd = (unsigned int)round(y);
+			}
+			if (view_width - xd < p) {
+				px = 1U;
+			}
+			else {
+				px = p;
+			}
+			if (view_height - yd < p) {
+				py = 1U;
+			}
+			else {
+				py = p;
+			}
+			block = blocks + lambdas * ly + lx;
+			block->x = xd;
+			block->y = yd;
+			block->width = px;
+			block->height = py;
+		} while (++ly < lambdas);
+	} while (++lx < lambdas);
+}
+
+static int puzzle_slot_matches(const PuzzleBlockSlot * const slot,
+	const unsigned int view_width,
+	const unsigned int view_height,
+	const unsigned int lambdas,
+	const double p_ratio)
+{
+	return slot->width == view_width && slot->height == view_height &&
+		slot->lambdas == lambdas && slot->p_ratio == p_ratio;
+}
+
+PuzzleBlockCache *puzzle_new_block_cache(void)
+{
+	return calloc((size_t)1U, sizeof(PuzzleBlockCache));
+}
+
+void puzzle_free_block_cache(PuzzleBlockCache * const cache)
+{
+	unsigned int slot;
+
+	if (cache == NULL) {
+		return;
+	}
+	for (slot = 0U; slot < PUZZLE_BLOCK_CACHE_SLOTS; slot++) {
+		free(cache->slots[slot].blocks);
+	}
+	free(cache);
+}
+
+static int puzzle_block_cache_lookup(PuzzleBlockCache * const cache,
+	PuzzleBlock * const blocks,
+	const unsigned int view_width,
+	const unsigned int view_height,
+	const unsigned int lambdas,
+	const double p_ratio,
+	const unsigned int home)
+{
+	const size_t nblocks = (size_t)lambdas * lambdas;
+	PuzzleBlockSlot *slot;
+	unsigned int probe;
+	long seq;
+
+	for (probe = 0U; probe < PUZZLE_BLOCK_CACHE_PROBES; probe++) {
+		slot = &cache->slots[(home + probe) % PUZZLE_BLOCK_CACHE_SLOTS];
+		seq = slot->seq;
+		if ((seq & 1L) != 0L) {
+			continue;
+		}
+		PUZZLE_BARRIER();
+		if (!puzzle_slot_matches(slot, view_width, view_height,
+			lambdas, p_ratio) || slot->capacity < nblocks) {
+			continue;
+		}
+		memcpy(blocks, slot->blocks, nblocks * sizeof *blocks);
+		PUZZLE_BARRIER();
+		if (slot->seq == seq) {
+			return 0;
+		}
+	}
+	return -1;
+}
+
+/*
+ * Stores a layout that just missed. A never written slot of the probe
+ * window is taken if there is one; once the window is full, the miss count
+ * picks which of its slots to overwrite, so that one-off sizes do not keep
+ * evicting the same entry. Gives up rather than wait when another thread
+ * is writing the slot.
+ */
+static void puzzle_block_cache_store(PuzzleBlockCache * const cache,
+	const PuzzleBlock * const blocks,
+	const unsigned int view_width,
+	const unsigned int view_height,
+	const unsigned int lambdas,
+	const double p_ratio,
+	const unsigned int home)
+{
+	const size_t nblocks = (size_t)lambdas * lambdas;
+	PuzzleBlockSlot *slot;
+	unsigned int probe;
+	long seq;
+
+	for (probe = 0U; probe < PUZZLE_BLOCK_CACHE_PROBES; probe++) {
+		slot = &cache->slots[(home + probe) % PUZZLE_BLOCK_CACHE_SLOTS];
+		if (slot->blocks == NULL) {
+			break;
+		}
+	}
+	if (probe >= PUZZLE_BLOCK_CACHE_PROBES) {
+		probe = (unsigned int)(cache->misses % PUZZLE_BLOCK_CACHE_PROBES);
+	}
+	slot = &cache->slots[(home + probe) % PUZZLE_BLOCK_CACHE_SLOTS];
+	seq = slot->seq;
+	if ((seq & 1L) != 0L || !PUZZLE_CAS_LONG(&slot->seq, seq, seq + 1L)) {
+		return;
+	}
+	if (slot->blocks == NULL &&
+		(slot->blocks = malloc(nblocks * sizeof *blocks)) != NULL) {
+		slot->capacity = nblocks;
+	}
+	if (slot->capacity >= nblocks) {
+		memcpy(slot->blocks, blocks, nblocks * sizeof *blocks);
+		slot->width = view_width;
+		slot->height = view_height;
+		slot->lambdas = lambdas;
+		slot->p_ratio = p_ratio;
+	}
+	PUZZLE_BARRIER();
+	slot->seq = seq + 2L;
+}
+
+/*
+ * Fills blocks with the layout for a view_width x view_height view,
+ * copying it from the context cache when it was already computed for the
+ * same size, lambdas and p ratio.
+ */
+void puzzle_get_blocks(PuzzleContext * const context,
+	PuzzleBlock * const blocks,
+	const unsigned int view_width,
+	const unsigned int view_height,
+	const unsigned int lambdas)
+{
+	PuzzleBlockCache * const cache = context->puzzle_block_cache;
+	const double p_ratio = context->puzzle_p_ratio;
+	unsigned int home;
+
+	if (cache == NULL) {
+		puzzle_compute_blocks(context, blocks, view_width, view_height,
+			lambdas);
+		return;
+	}
+	home = ((view_width * 31U + view_height) * 31U + lambdas) %
+		PUZZLE_BLOCK_CACHE_SLOTS;
+	if (puzzle_block_cache_lookup(cache, blocks, view_width, view_height,
+		lambdas, p_ratio, home) == 0) {
+		puzzle_atomic_inc(&cache->hits);
+		return;
+	}
+	puzzle_atomic_inc(&cache->misses);
+	puzzle_compute_blocks(context, blocks, view_width, view_height, lambdas);
+	puzzle_block_cache_store(cache, blocks, view_width, view_height,
+		lambdas, p_ratio, home);
+}
+
+void puzzle_get_block_cache_stats(PuzzleContext * const context,
+	unsigned long long * const hits,
+	unsigned long long * const misses)
+{
+	PuzzleBlockCache * const cache = context->puzzle_block_cache;
+
+	*hits = cache != NULL ? cache->hits : 0ULL;
+	*misses = cache != NULL ? cache->misses : 0ULL;
+}
@@ -0,0 +1,91 @@
+#include "puzzle_common.h"
+#include "puzzle_p.h"
+#include "puzzle.h"
+#include "globals.h"
+
+#ifdef PUZZLE_X86
+# ifdef _MSC_VER
+#  include <intrin.h>
+# else
+#  include <cpuid.h>
+# endif
+
+static void puzzle_cpuid(const unsigned int leaf, const unsigned int subleaf,
+	unsigned int regs[4])
+{
+# ifdef _MSC_VER
+	int r[4];
+
+	__cpuidex(r, (int)leaf, (int)subleaf);
+	regs[0] = (unsigned int)r[0];
+	regs[1] = (unsigned int)r[1];
+	regs[2] = (unsigned int)r[2];
+	regs[3] = (unsigned int)r[3];
+# else
+	__cpuid_count(leaf, subleaf, regs[0], regs[1], regs[2], regs[3]);
+# endif
+}
+
+static unsigned long long puzzle_xgetbv0(void)
+{
+# ifdef _MSC_VER
+	return (unsigned long long)_xgetbv(0);
+# else
+	unsigned int eax, edx;
+
+	__asm__ __volatile__("xgetbv" : "=a" (eax), "=d" (edx) : "c" (0));
+	return ((unsigned long long)edx << 32) | eax;
+# endif
+}
+
+static unsigned int puzzle_detect_cpu_features(void)
+{
+	unsigned int regs[4];
+	unsigned int max_leaf;
+	unsigned int features = 0U;
+	unsigned long long xcr0 = 0ULL;
+
+	puzzle_cpuid(0U, 0U, regs);
+	max_leaf = regs[0];
+	if (max_leaf < 1U) {
+		return 0U;
+	}
+	puzzle_cpuid(1U, 0U, regs);
+	if ((regs[3] & (1U << 26)) != 0U) {
+		features |= PUZZLE_CPU_SSE2;
+	}
+	if ((regs[2] & (1U << 19)) != 0U) {
+		features |= PUZZLE_CPU_SSE41;
+	}
+	/* the OS has to save the wider registers too (OSXSAVE + XCR0) */
+	if ((regs[2] & (1U << 27)) != 0U) {
+		xcr0 = puzzle_xgetbv0();
+	}
+	if (max_leaf < 7U || (xcr0 & 0x6ULL) != 0x6ULL) {
+		return features;
+	}
+	puzzle_cpuid(7U, 0U, regs);
+	if ((regs[1] & (1U << 5)) != 0U) {
+		features |= PUZZLE_CPU_AVX2;
+	}
+	if ((regs[1] & (1U << 30)) != 0U && (xcr0 & 0xe6ULL) == 0xe6ULL) {
+		features |= PUZZLE_CPU_AVX512BW;
+	}
+	return features;
+}
+#endif
+
+unsigned int puzzle_cpu_features(void)
+{
+	/* detection is idempotent, so racing first calls are harmless */
+	static volatile int detected = 0;
+	static volatile unsigned int features = 0U;
+
+	if (detected == 0) {
+#ifdef PUZZLE_X86
+		features = puzzle_detect_cpu_features();
+#endif
+		detected = 1;
+	}
+	return features;
+}
@@ -3,29 +3,65 @@
 #include "puzzle.h"
 #include "globals.h"
 
-static int puzzle_median_cmp(const void * const a_, const void * const b_)
+/*
+ * Wirth's selection: leaves the k-th smallest value at vec[k], with
+ * nothing larger before it and nothing smaller after it.
+ */
+static double puzzle_select(double * const vec, const size_t size,
+                            const size_t k)
 {
-    const double a = * (const double *) a_;
-    const double b = * (const double *) b_;
-    
-    if (a < b) {
-        return -1;
-    } else if (a > b) {
-        return 1;
+    ptrdiff_t l = (ptrdiff_t) 0, m = (ptrdiff_t) size - 1;
+    ptrdiff_t i, j;
+    const ptrdiff_t kk = (ptrdiff_t) k;
+    double x;
+    double t;
+
+    while (l < m) {
+        x = vec[kk];
+        i = l;
+        j = m;
+        do {
+            while (vec[i] < x) {
+                i++;
+            }
+            while (x < vec[j]) {
+                j--;
+            }
+            if (i <= j) {
+                t = vec[i];
+                vec[i] = vec[j];
+                vec[j] = t;
+                i++;
+                j--;
+            }
+        } while (i <= j);
+        if (j < kk) {
+            l = i;
+        }
+        if (kk < i) {
+            m = j;
+        }
     }
-    return 0;
+    return vec[kk];
 }
 
+/*
+ * Same cutoff the sort-based version gave: the mean of the n-th and
+ * (n + 1)-th smallest values, found in linear time. With exactly two
+ * values, o points one past the end, where the zeroed scratch array
+ * used to supply 0.0; that is kept.
+ */
 static double puzzle_median(double * const vec, size_t size)
 {
     size_t n;
     size_t o;
+    size_t i;
     double avg;
+    double vn, vo;
 
     if (size <= (size_t) 0U) {
         return 0.0;
     }
-    qsort((void *) vec, size, sizeof *vec, puzzle_median_cmp);
     if ((n = size / (size_t) 2U) == (size_t) 0U) {
         if (size > (size_t) 1U) {
             o = (size_t) 1U;
@@ -38,13 +74,69 @@ static double puzzle_median(double * const vec, size_t size)
     if (o < n) {
         puzzle_err_bug(__FILE__, __LINE__);
     }
-    avg = (vec[n] + vec[o]) / 2.0;
-    if (avg < vec[n] || avg > vec[o]) {
-        avg = vec[n];
+    vn = puzzle_select(vec, size, n);
+    if (o == n) {
+        vo = vn;
+    } else if (o >= size) {
+        vo = 0.0;
+    } else {
+        vo = vec[o];
+        for (i = o + (size_t) 1U; i < size; i++) {
+            if (vec[i] < vo) {
+                vo = vec[i];
+            }
+        }
+    }
+    avg = (vn + vo) / 2.0;
+    if (avg < vn || avg > vo) {
+        avg = vn;
     }
     return avg;
 }
 
+/*
+ * Lights fill the levels from the front and darks from the back,
+ * noise is left out.
+ */
+static void puzzle_split_levels(PuzzleContext * const context,
+                                const double *diffs, size_t n,
+                                double * const lights,
+                                size_t * const pos_lights,
+                                double ** const darks,
+                                size_t * const pos_darks)
+{
+    double dv;
+
+    while (n-- > (size_t) 0U) {
+        dv = *diffs++;
+        if (dv >= - context->puzzle_noise_cutoff &&
+            dv <= context->puzzle_noise_cutoff) {
+            continue;
+        }
+        if (dv < context->puzzle_noise_cutoff) {
+            *--*darks = dv;
+            (*pos_darks)++;
+        } else if (dv > context->puzzle_noise_cutoff) {
+            lights[(*pos_lights)++] = dv;
+        }
+    }
+}
+
+static inline signed char puzzle_quantize(PuzzleContext * const context,
+                                          const double dv,
+                                          const double lighter_cutoff,
+                                          const double darker_cutoff)
+{
+    if (dv >= - context->puzzle_noise_cutoff &&
+        dv <= context->puzzle_noise_cutoff) {
+        return 0;
+    }
+    if (dv < 0.0) {
+        return dv < darker_cutoff ? -2 : -1;
+    }
+    return dv > lighter_cutoff ? +2 : +1;
+}
+
 int puzzle_fill_cvec_from_dvec(PuzzleContext * const context,
                                PuzzleCvec * const cvec,
                                const PuzzleDvec * const dvec)
@@ -52,12 +144,11 @@ int puzzle_fill_cvec_from_dvec(PuzzleContext * const context,
     size_t s;
     const double *dvecptr;
     signed char *cvecptr;
-    double *lights = NULL, *darks = NULL;
+    double stack_levels[PUZZLE_CVEC_STACK_SCRATCH];
+    double *levels = stack_levels;
+    double *lights, *darks;
     size_t pos_lights = (size_t) 0U, pos_darks = (size_t) 0U;
-    size_t sizeof_lights, sizeof_darks;
     double lighter_cutoff, darker_cutoff;
-    int err = 0;    
-    double dv;
 
     if ((cvec->sizeof_vec = dvec->sizeof_compressed_vec) <= (size_t) 0U) {
         puzzle_err_bug(__FILE__, __LINE__);
@@ -65,60 +156,113 @@ int puzzle_fill_cvec_from_dvec(PuzzleContext * const context,
     if ((cvec->vec = calloc(cvec->sizeof_vec, sizeof *cvec->vec)) == NULL) {
         return -1;
     }
-    sizeof_lights = sizeof_darks = cvec->sizeof_vec;
-    if ((lights = calloc(sizeof_lights, sizeof *lights)) == NULL ||
-        (darks = calloc(sizeof_darks, sizeof *darks)) == NULL) {
-        err = -1;
-        goto out;
+    if (cvec->sizeof_vec > (size_t) PUZZLE_CVEC_STACK_SCRATCH &&
+        (levels = malloc(cvec->sizeof_vec * sizeof *levels)) == NULL) {
+        return -1;
+    }
+    lights = levels;
+    darks = levels + cvec->sizeof_vec;
+    puzzle_split_levels(context, dvec->vec, cvec->sizeof_vec,
+                        lights, &pos_lights, &darks, &pos_darks);
+    if (pos_lights + pos_darks > cvec->sizeof_vec) {
+        puzzle_err_bug(__FILE__, __LINE__);
     }
-    dvecptr = dvec->vec;
-    s = cvec->sizeof_vec;
-    do {
-        dv = *dvecptr++;
-        if (dv >= - context->puzzle_noise_cutoff &&
-            dv <= context->puzzle_noise_cutoff) {
-            continue;
-        }
-        if (dv < context->puzzle_noise_cutoff) {
-            darks[pos_darks++] = dv;
-            if (pos_darks > sizeof_darks) {
-                puzzle_err_bug(__FILE__, __LINE__);
-            }
-        } else if (dv > context->puzzle_noise_cutoff) {
-            lights[pos_lights++] = dv;
-            if (pos_lights > sizeof_lights) {
-                puzzle_err_bug(__FILE__, __LINE__);
-            }
-        }
-    } while (--s != (size_t) 0U);
     lighter_cutoff = puzzle_median(lights, pos_lights);
-    darker_cutoff = puzzle_median(darks, pos_darks);    
-    free(lights);
-    lights = NULL;
-    free(darks);
-    darks = NULL;
+    darker_cutoff = puzzle_median(darks, pos_darks);
     dvecptr = dvec->vec;
     cvecptr = cvec->vec;
     s = cvec->sizeof_vec;
     do {
-        dv = *dvecptr++;
-        if (dv >= - context->puzzle_noise_cutoff &&
-            dv <= context->puzzle_noise_cutoff) {
-            *cvecptr++ = 0;
-        } else if (dv < 0.0) {
-            *cvecptr++ = dv < darker_cutoff ? -2 : -1;
-        } else {
-            *cvecptr++ = dv > lighter_cutoff ? +2 : +1;
-        }
+        *cvecptr++ = puzzle_quantize(context, *dvecptr++,
+                                     lighter_cutoff, darker_cutoff);
     } while (--s != (size_t) 0U);
     if ((size_t) (cvecptr - cvec->vec) != cvec->sizeof_vec) {
         puzzle_err_bug(__FILE__, __LINE__);
     }
-    out:
-    free(lights);
-    free(darks);
-    
-    return err;
+    if (levels != stack_levels) {
+        free(levels);
+    }
+    return 0;
+}
+
+/*
+ * Same cvec as puzzle_fill_cvec_from_dvec() on the dvec these levels
+ * would give, without building it: the differences of each grid column
+ * are produced twice, with the same neighbor runs as puzzle_fill_dvec(),
+ * once to find the cutoffs and once to quantize them, which is cheaper
+ * than storing and reading back a dvec of doubles.
+ */
+int puzzle_fill_cvec_from_avglvls(PuzzleContext * const context,
+                                  PuzzleCvec * const cvec,
+                                  const PuzzleAvgLvls * const avglvls,
+                                  PuzzleScratch * const scratch)
+{
+    const unsigned int lambdas = avglvls->lambdas;
+    double *diffs;
+    double stack_levels[PUZZLE_CVEC_STACK_SCRATCH];
+    double *levels = stack_levels;
+    double *lights, *darks;
+    size_t sizeof_levels;
+    size_t pos_lights = (size_t) 0U, pos_darks = (size_t) 0U;
+    double lighter_cutoff, darker_cutoff;
+    signed char *cvecptr;
+    unsigned int lx;
+    unsigned int n, i;
+
+    sizeof_levels = (size_t) lambdas * lambdas * PUZZLE_NEIGHBORS;
+    if (lambdas <= 0U || UINT_MAX / lambdas < lambdas ||
+        (unsigned int) sizeof_levels != sizeof_levels) {
+        puzzle_err_bug(__FILE__, __LINE__);
+    }
+    /* centers on the border have fewer neighbors, this is an upper bound */
+    if ((cvec->vec = puzzle_scratch_malloc(scratch, sizeof_levels)) == NULL) {
+        return -1;
+    }
+    if ((diffs = puzzle_scratch_malloc
+         (scratch, (size_t) lambdas * PUZZLE_NEIGHBORS * sizeof *diffs))
+        == NULL) {
+        goto nomem;
+    }
+    if (sizeof_levels > (size_t) PUZZLE_CVEC_STACK_SCRATCH &&
+        (levels = puzzle_scratch_malloc
+         (scratch, sizeof_levels * sizeof *levels)) == NULL) {
+        puzzle_scratch_free(scratch, diffs);
+        goto nomem;
+    }
+    lights = levels;
+    darks = levels + sizeof_levels;
+    cvec->sizeof_vec = (size_t) 0U;
+    for (lx = 0U; lx < lambdas; lx++) {
+        n = puzzle_get_column_neighbors(avglvls, lx, diffs);
+        cvec->sizeof_vec += n;
+        puzzle_split_levels(context, diffs, n,
+                            lights, &pos_lights, &darks, &pos_darks);
+    }
+    if (cvec->sizeof_vec <= (size_t) 0U ||
+        cvec->sizeof_vec > sizeof_levels ||
+        pos_lights + pos_darks > cvec->sizeof_vec) {
+        puzzle_err_bug(__FILE__, __LINE__);
+    }
+    lighter_cutoff = puzzle_median(lights, pos_lights);
+    darker_cutoff = puzzle_median(darks, pos_darks);
+    cvecptr = cvec->vec;
+    for (lx = 0U; lx < lambdas; lx++) {
+        n = puzzle_get_column_neighbors(avglvls, lx, diffs);
+        for (i = 0U; i < n; i++) {
+            *cvecptr++ = puzzle_quantize(context, diffs[i],
+                                         lighter_cutoff, darker_cutoff);
+        }
+    }
+    if (levels != stack_levels) {
+        puzzle_scratch_free(scratch, levels);
+    }
+    puzzle_scratch_free(scratch, diffs);
+    return 0;
+
+nomem:
+    puzzle_scratch_free(scratch, cvec->vec);
+    cvec->vec = NULL;
+    return -1;
 }
 
 void puzzle_init_cvec(PuzzleContext * const context, PuzzleCvec * const cvec)
@@ -172,14 +316,44 @@ int puzzle_fill_cvec_from_file(PuzzleContext * const context,
                                PuzzleCvec * const cvec,
                                const char * const file)
 {
-    PuzzleDvec dvec;
-    int ret;
-    
-    puzzle_init_dvec(context, &dvec);
-    if ((ret = puzzle_fill_dvec_from_file(context, &dvec, file)) == 0) {
-        ret = puzzle_fill_cvec_from_dvec(context, cvec, &dvec);
+    return puzzle_fill_vec_from_file(context, NULL, cvec, file, NULL);
+}
+
+/*
+ * Everything, down to cvec->vec, comes from the scratch, which is reset
+ * on entry: the cvec stays valid until the next call with the same
+ * scratch and must not be passed to puzzle_free_cvec().
+ */
+int puzzle_fill_cvec_from_file_scratch(PuzzleContext * const context,
+                                       PuzzleCvec * const cvec,
+                                       const char * const file,
+                                       PuzzleScratch * const scratch)
+{
+    puzzle_init_cvec(context, cvec);
+    if (puzzle_scratch_begin(scratch) != 0) {
+        return -1;
     }
-    puzzle_free_dvec(context, &dvec);
-    
-    return ret;
+    return puzzle_fill_vec_from_file(context, NULL, cvec, file, scratch);
+}
+
+int puzzle_fill_cvec_from_memory(PuzzleContext * const context,
+                                 PuzzleCvec * const cvec,
+                                 const void * const buf, const size_t len)
+{
+    return puzzle_fill_vec_from_memory(context, NULL, cvec, buf, len, NULL);
+}
+
+/* Same contract as puzzle_fill_cvec_from_file_scratch() */
+int puzzle_fill_cvec_from_memory_scratch(PuzzleContext * const context,
+                                         PuzzleCvec * const cvec,
+                                         const void * const buf,
+                                         const size_t len,
+                                         PuzzleScratch * const scratch)
+{
+    puzzle_init_cvec(context, cvec);
+    if (puzzle_scratch_begin(scratch) != 0) {
+        return -1;
+    }
+    return puzzle_fill_vec_from_memory(context, NULL, cvec, buf, len,
+                                       scratch);
 }
@@ -3,17 +3,31 @@
 #include "puzzle.h"
 #include "globals.h"
 #include <cilk/cilk.h>
+#include <cilk/cilk_api.h>
+#if defined(__SSE2__) || defined(_M_X64) || \
+	(defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+# include <emmintrin.h>
+# define PUZZLE_VIEW_SSE2 1
+#endif
 
 static void puzzle_init_view(PuzzleView * const view)
 {
 	view->width = view->height = 0U;
+	view->origin = view->stride = (size_t)0U;
 	view->sizeof_map = (size_t)0U;
 	view->map = NULL;
+	view->col_contrasts = view->row_contrasts = NULL;
+	view->blocks = NULL;
+	view->scratch = NULL;
 }
 
 static void puzzle_free_view(PuzzleView * const view)
 {
-	free(view->map);
+	puzzle_scratch_free(view->scratch, view->blocks);
+	view->blocks = NULL;
+	puzzle_scratch_free(view->scratch, view->col_contrasts);
+	view->col_contrasts = view->row_contrasts = NULL;
+	puzzle_scratch_free(view->scratch, view->map);
 	view->map = NULL;
 }
 
@@ -24,9 +38,10 @@ static void puzzle_init_avglvls(PuzzleAvgLvls * const avglvls)
 	avglvls->lvls = NULL;
 }
 
-static void puzzle_free_avglvls(PuzzleAvgLvls * const avglvls)
+static void puzzle_free_avglvls(PuzzleAvgLvls * const avglvls,
+	PuzzleScratch * const scratch)
 {
-	free(avglvls->lvls);
+	puzzle_scratch_free(scratch, avglvls->lvls);
 	avglvls->lvls = NULL;
 }
 
@@ -44,9 +59,12 @@ void puzzle_free_dvec(PuzzleContext * const context, PuzzleDvec * const dvec)
 	dvec->vec = NULL;
 }
 
-static PuzzleImageTypeCode puzzle_get_image_type_from_fp(FILE * const fp)
-{
 #define MAX_SIGNATURE_LENGTH 8U
+
+static PuzzleImageTypeCode
+puzzle_get_image_type_from_header(const unsigned char * const header,
+	const size_t sizeof_header)
+{
 	static const PuzzleImageType image_types[] = {
 			{ (size_t)4U, (const unsigned char *)
 			"GIF8", PUZZLE_IMAGE_TYPE_GIF },
@@ -57,29 +75,38 @@ static PuzzleImageTypeCode puzzle_get_image_type_from_fp(FILE * const fp)
 			{ (size_t)0U, NULL, PUZZLE_IMAGE_TYPE_UNKNOWN }
 	};
 	const PuzzleImageType *image_type = image_types;
-	PuzzleImageTypeCode ret = PUZZLE_IMAGE_TYPE_ERROR;
-	unsigned char header[MAX_SIGNATURE_LENGTH];
-	fpos_t pos;
 
-	if (fgetpos(fp, &pos) != 0) {
+	if (sizeof_header < MAX_SIGNATURE_LENGTH) {
 		return PUZZLE_IMAGE_TYPE_ERROR;
 	}
-	rewind(fp);
-	if (fread(header, (size_t)1U, sizeof header, fp) != sizeof header) {
-		goto bye;
-	}
-	ret = PUZZLE_IMAGE_TYPE_UNKNOWN;
 	do {
-		if (image_type->sizeof_signature > sizeof header) {
+		if (image_type->sizeof_signature > MAX_SIGNATURE_LENGTH) {
 			puzzle_err_bug(__FILE__, __LINE__);
 		}
 		if (memcmp(header, image_type->signature,
 			image_type->sizeof_signature) == 0) {
-			ret = image_type->image_type_code;
-			break;
+			return image_type->image_type_code;
 		}
 		image_type++;
 	} while (image_type->signature != NULL);
+
+	return PUZZLE_IMAGE_TYPE_UNKNOWN;
+}
+
+static PuzzleImageTypeCode puzzle_get_image_type_from_fp(FILE * const fp)
+{
+	PuzzleImageTypeCode ret = PUZZLE_IMAGE_TYPE_ERROR;
+	unsigned char header[MAX_SIGNATURE_LENGTH];
+	fpos_t pos;
+
+	if (fgetpos(fp, &pos) != 0) {
+		return PUZZLE_IMAGE_TYPE_ERROR;
+	}
+	rewind(fp);
+	if (fread(header, (size_t)1U, sizeof header, fp) != sizeof header) {
+		goto bye;
+	}
+	ret = puzzle_get_image_type_from_header(header, sizeof header);
 bye:
 	if (fsetpos(fp, &pos) != 0) {
 		puzzle_err_bug(__FILE__, __LINE__);
@@ -87,26 +114,148 @@ bye:
 	return ret;
 }
 
+typedef struct PuzzleProbe_ {
+	FILE *fp;
+	const unsigned char *buf;
+	size_t len;
+} PuzzleProbe;
+
+static int puzzle_probe_read(const PuzzleProbe * const probe,
+	const size_t offset, unsigned char * const out, const size_t n)
+{
+	if (probe->fp != NULL) {
+		if (offset > (size_t)LONG_MAX ||
+			fseek(probe->fp, (long)offset, SEEK_SET) != 0 ||
+			fread(out, (size_t)1U, n, probe->fp) != n) {
+			return -1;
+		}
+		return 0;
+	}
+	if (offset > probe->len || probe->len - offset < n) {
+		return -1;
+	}
+	memcpy(out, probe->buf + offset, n);
+
+	return 0;
+}
+
+#define PUZZLE_BE16(P) (((unsigned int)(P)[0] << 8) | (unsigned int)(P)[1])
+#define PUZZLE_LE16(P) (((unsigned int)(P)[1] << 8) | (unsigned int)(P)[0])
+#define PUZZLE_BE32(P) (((unsigned long)(P)[0] << 24) | \
+	((unsigned long)(P)[1] << 16) | ((unsigned long)(P)[2] << 8) | \
+	(unsigned long)(P)[3])
+
+/*
+ * Walks the JPEG markers up to the first SOFn segment. Returns 1 when the
+ * scan starts (or the stream ends) before a frame header was seen.
+ */
+static int puzzle_probe_jpeg_size(const PuzzleProbe * const probe,
+	unsigned long * const width, unsigned long * const height)
+{
+	unsigned char segment[7];
+	size_t offset = (size_t)2U;
+	unsigned int marker;
+
+	for (;;) {
+		if (puzzle_probe_read(probe, offset, segment, (size_t)2U) != 0) {
+			return 1;
+		}
+		if (segment[0] != 0xff) {
+			return 1;
+		}
+		marker = segment[1];
+		if (marker == 0xff) {
+			offset++;
+			continue;
+		}
+		offset += (size_t)2U;
+		if (marker == 0x01 || (marker >= 0xd0 && marker <= 0xd7)) {
+			continue;
+		}
+		if (marker == 0xd9 || marker == 0xda) {
+			return 1;
+		}
+		if (puzzle_probe_read(probe, offset, segment, sizeof segment) != 0) {
+			return 1;
+		}
+		if (marker >= 0xc0 && marker <= 0xcf &&
+			marker != 0xc4 && marker != 0xc8 && marker != 0xcc) {
+			*height = PUZZLE_BE16(segment + 3);
+			*width = PUZZLE_BE16(segment + 5);
+			return 0;
+		}
+		if (PUZZLE_BE16(segment) < 2U) {
+			return 1;
+		}
+		offset += (size_t)PUZZLE_BE16(segment);
+	}
+}
+
+/*
+ * Reads the image dimensions from the JPEG frame header, the PNG IHDR
+ * chunk or the GIF logical screen descriptor without decoding anything.
+ * Returns 0 when they were found, 1 when the header doesn't tell.
+ */
+static int puzzle_probe_image_size(const PuzzleProbe * const probe,
+	const PuzzleImageTypeCode image_type_code,
+	unsigned long * const width, unsigned long * const height)
+{
+	unsigned char header[24];
+
+	switch (image_type_code) {
+	case PUZZLE_IMAGE_TYPE_JPEG:
+		return puzzle_probe_jpeg_size(probe, width, height);
+	case PUZZLE_IMAGE_TYPE_PNG:
+		if (puzzle_probe_read(probe, (size_t)0U, header,
+			(size_t)24U) != 0 || memcmp(header + 12, "IHDR", 4) != 0) {
+			return 1;
+		}
+		*width = PUZZLE_BE32(header + 16);
+		*height = PUZZLE_BE32(header + 20);
+		return 0;
+	case PUZZLE_IMAGE_TYPE_GIF:
+		if (puzzle_probe_read(probe, (size_t)0U, header,
+			(size_t)10U) != 0) {
+			return 1;
+		}
+		*width = PUZZLE_LE16(header + 6);
+		*height = PUZZLE_LE16(header + 8);
+		return 0;
+	default:
+		return 1;
+	}
+}
+
+static int puzzle_probe_too_large(PuzzleContext * const context,
+	const PuzzleProbe * const probe,
+	const PuzzleImageTypeCode image_type_code)
+{
+	unsigned long width, height;
+
+	if (puzzle_probe_image_size(probe, image_type_code,
+		&width, &height) != 0) {
+		return 0;
+	}
+	return width > (unsigned long)context->puzzle_max_width ||
+		height > (unsigned long)context->puzzle_max_height;
+}
+
 static int puzzle_autocrop_axis(PuzzleContext * const context,
-	PuzzleView * const view,
+	PuzzleScratch * const scratch,
 	unsigned int * const crop0,
 	unsigned int * const crop1,
 	const unsigned int axisn,
 	const unsigned int axiso,
-	const int omaptrinc, const int nmaptrinc)
+	const unsigned long long * const sums)
 {
 	double *chunk_contrasts;
 	size_t sizeof_chunk_contrasts;
 	double chunk_contrast = 0.0, total_contrast = 0.0, barrier_contrast;
-	unsigned char level = 0U;
-	unsigned char previous_level = 0U;
-	unsigned int chunk_n, chunk_o;
-	unsigned int chunk_n1, chunk_o1;
+	unsigned int chunk_n;
+	unsigned int chunk_n1;
 	unsigned int max_crop;
-	const unsigned char *maptr;
 
 	chunk_n1 = axisn - 1U;
-	chunk_o1 = axiso - 1U;
 	*crop0 = 0U;
 	*crop1 = chunk_n1;
 	if (axisn < (unsigned int)PUZZLE_MIN_SIZE_FOR_CROPPING ||
@@ -114,34 +263,22 @@ static int puzzle_autocrop_axis(PuzzleContext * const context,
 		return 1;
 	}
 	sizeof_chunk_contrasts = chunk_n1 + 1U;
-	if ((chunk_contrasts = calloc(sizeof_chunk_contrasts,
-		sizeof *chunk_contrasts)) == NULL) {
+	if ((chunk_contrasts = puzzle_scratch_calloc(scratch,
+		sizeof_chunk_contrasts, sizeof *chunk_contrasts)) == NULL) {
 		return -1;
 	}
-	maptr = view->map;
 	if (axisn >= INT_MAX || axiso >= INT_MAX) {
 		puzzle_err_bug(__FILE__, __LINE__);
 	}
 	if (INT_MAX / axisn < axiso) {
 		puzzle_err_bug(__FILE__, __LINE__);
 	}
+	// chunks run from the last map line down to the first
 	chunk_n = chunk_n1;
 	do {
-		chunk_contrast = 0.0;
-		chunk_o = chunk_o1;
-		do {
-			level = *maptr;
-			if (previous_level > level) {
-				chunk_contrast += (double)(previous_level - level);
-			}
-			else {
-				chunk_contrast += (double)(level - previous_level);
-			}
-			maptr += omaptrinc;
-		} while (chunk_o-- != 0U);
+		chunk_contrast = (double)sums[chunk_n1 - chunk_n];
 		chunk_contrasts[chunk_n] = chunk_contrast;
 		total_contrast += chunk_contrast;
-		maptr += nmaptrinc;
 	} while (chunk_n-- != 0U);
 	barrier_contrast =
 		total_contrast * context->puzzle_contrast_barrier_for_cropping;
@@ -161,7 +298,7 @@ static int puzzle_autocrop_axis(PuzzleContext * const context,
 			break;
 		}
 	} while ((*crop1)-- > 0U);
-	free(chunk_contrasts);
+	puzzle_scratch_free(scratch, chunk_contrasts);
 	if (*crop0 > chunk_n1 || *crop1 > chunk_n1) {
 		puzzle_err_bug(__FILE__, __LINE__);
 	}
@@ -179,55 +316,305 @@ static int puzzle_autocrop_axis(PuzzleContext * const context,
 static int puzzle_autocrop_view(PuzzleContext * context,
 	PuzzleView * const view)
 {
-	unsigned int cropx0, cropx1, cropx_max;
+	unsigned int cropx0, cropx1;
 	unsigned int cropy0, cropy1;
 
-	//unsigned int  y; // x
-
-	if (puzzle_autocrop_axis(context, view, &cropx0, &cropx1,
-		view->width, view->height,
-		(int)view->width,
-		1 - (int)(view->width * view->height)) < 0 ||
-		puzzle_autocrop_axis(context, view, &cropy0, &cropy1,
-		view->height, view->width,
-		1, 0) < 0) {
+	if (view->width < (unsigned int)PUZZLE_MIN_SIZE_FOR_CROPPING ||
+		view->height < (unsigned int)PUZZLE_MIN_SIZE_FOR_CROPPING) {
+		return 0;
+	}
+	// every producer gathers the contrasts whenever autocrop will run
+	if (view->col_contrasts == NULL) {
+		puzzle_err_bug(__FILE__, __LINE__);
+	}
+	if (puzzle_autocrop_axis(context, view->scratch, &cropx0, &cropx1,
+		view->width, view->height, view->col_contrasts) < 0 ||
+		puzzle_autocrop_axis(context, view->scratch, &cropy0, &cropy1,
+		view->height, view->width, view->row_contrasts) < 0) {
 		return -1;
 	}
+	puzzle_scratch_free(view->scratch, view->col_contrasts);
+	view->col_contrasts = view->row_contrasts = NULL;
 	if (cropx0 > cropx1 || cropy0 > cropy1) {
 		puzzle_err_bug(__FILE__, __LINE__);
 	}
 
-	// copy the map/image to enable thread safe readOnly access
-	size_t arraySize = view->sizeof_map*sizeof(unsigned char);
-	unsigned char *readOnlyMaptr = malloc(arraySize);
-	memcpy(readOnlyMaptr, view->map, arraySize);
-	//Paralized for loop 
-	cilk_for(unsigned int localy = cropy0; localy <= cropy1; localy++)
-	{
-		unsigned int iteration = localy - cropy0;
-		unsigned int x = cropx0;
-		//Compute pointer value for each loop to avoid data races
-		unsigned char* base_maptr = (view->map + iteration*(cropx1 - cropx0 + 1));
-		unsigned int xIter = 0;
+	// no copy: the cropped view just starts further into the same map
+	view->origin += (size_t)cropy0 * view->stride + cropx0;
+	view->width = cropx1 - cropx0 + 1U;
+	view->height = cropy1 - cropy0 + 1U;
+	if (view->width <= 0U || view->height <= 0U) {
+		puzzle_err_bug(__FILE__, __LINE__);
+	}
+	return 0;
+}
+
+#ifdef PUZZLE_VIEW_SSE2
+/* Adds 4 zero-extended 32-bit levels to sums[0..3] */
+static inline void puzzle_add_dwords(unsigned long long * const sums,
+	const __m128i dwords, const __m128i zero)
+{
+	__m128i * const out = (__m128i *)sums;
+
+	_mm_storeu_si128(out, _mm_add_epi64(_mm_loadu_si128(out),
+		_mm_unpacklo_epi32(dwords, zero)));
+	_mm_storeu_si128(out + 1, _mm_add_epi64(_mm_loadu_si128(out + 1),
+		_mm_unpackhi_epi32(dwords, zero)));
+}
+#endif
+
+/*
+ * Adds the n levels of a run to the column contrasts sums[0..n-1] and
+ * returns their total, for the row contrast. SSE2 is part of every x86-64
+ * target, so this is inlined without dispatch: each 16 levels are loaded
+ * once, summed by a SAD against zero and widened in registers to the
+ * 64-bit column sums.
+ */
+static inline unsigned long long puzzle_add_run_contrasts(
+	unsigned long long * const sums,
+	const unsigned char * const run,
+	const unsigned int n)
+{
+	unsigned long long total = 0ULL;
+	unsigned int i = 0U;
+#ifdef PUZZLE_VIEW_SSE2
+	const __m128i zero = _mm_setzero_si128();
+	__m128i totals = zero;
+	__m128i bytes, words;
+	unsigned long long lanes[2];
+
+	for (; i + 16U <= n; i += 16U) {
+		bytes = _mm_loadu_si128((const __m128i *)(run + i));
+		totals = _mm_add_epi64(totals, _mm_sad_epu8(bytes, zero));
+		words = _mm_unpacklo_epi8(bytes, zero);
+		puzzle_add_dwords(sums + i, _mm_unpacklo_epi16(words, zero), zero);
+		puzzle_add_dwords(sums + i + 4U,
+			_mm_unpackhi_epi16(words, zero), zero);
+		words = _mm_unpackhi_epi8(bytes, zero);
+		puzzle_add_dwords(sums + i + 8U,
+			_mm_unpacklo_epi16(words, zero), zero);
+		puzzle_add_dwords(sums + i + 12U,
+			_mm_unpackhi_epi16(words, zero), zero);
+	}
+	_mm_storeu_si128((__m128i *)lanes, totals);
+	total = lanes[0] + lanes[1];
+#endif
+	for (; i < n; i++) {
+		total += run[i];
+		sums[i] += run[i];
+	}
+	return total;
+}
+
+/*
+ * Converts one tile of the gd image along its rows into a small row-major
+ * block, then transposes the block into the mirrored, column-major map.
+ * When sums is not NULL, every level is also added to the column (sums)
+ * and row (sums + width) contrasts of the map position it lands in. Each
+ * tile column is one contiguous run of the map, so it only spans one or
+ * two map rows, whose contrasts get the sum of their part of the run.
+ */
+static void puzzle_getview_tile(const PuzzleView * const view,
+	const gdImagePtr gdimage,
+	const unsigned char * const lut,
+	const PuzzleLumaRowFn luma_row,
+	const unsigned int tx0, const unsigned int ty0,
+	unsigned long long * const sums)
+{
+	unsigned char block[PUZZLE_LUMA_TILE * PUZZLE_LUMA_TILE];
+	const unsigned int tw = MIN(PUZZLE_LUMA_TILE, view->width - tx0);
+	const unsigned int th = MIN(PUZZLE_LUMA_TILE, view->height - ty0);
+	unsigned char *maptr;
+	const unsigned char *blockptr;
+	const unsigned char *row;
+	const unsigned char *run;
+	size_t offset;
+	unsigned int mx, my;
+	unsigned int r, c;
+	unsigned int left, seg;
+
+	for (r = 0U; r < th; r++) {
+		if (luma_row != NULL) {
+			luma_row(block + r * PUZZLE_LUMA_TILE,
+				gdimage->tpixels[ty0 + r] + tx0, (size_t)tw);
+		}
+		else {
+			row = gdimage->pixels[ty0 + r] + tx0;
+			for (c = 0U; c < tw; c++) {
+				block[r * PUZZLE_LUMA_TILE + c] = lut[row[c]];
+			}
+		}
+	}
+	for (c = 0U; c < tw; c++) {
+		offset = (size_t)(view->width - 1U - (tx0 + c)) * view->height +
+			(view->height - (ty0 + th));
+		maptr = view->map + offset;
+		blockptr = block + (th - 1U) * PUZZLE_LUMA_TILE + c;
+		r = th;
+		do {
+			*maptr++ = *blockptr;
+			blockptr -= PUZZLE_LUMA_TILE;
+		} while (--r != 0U);
+		if (sums == NULL) {
+			continue;
+		}
+		run = view->map + offset;
+		mx = (unsigned int)(offset % view->width);
+		my = (unsigned int)(offset / view->width);
+		left = th;
 		do {
-			unsigned char* oldPos = readOnlyMaptr + view->width * localy + x;
-			*base_maptr = *(oldPos); //PUZZLE_VIEW_PIXEL(view, x, localy);
-			base_maptr++;
-			xIter++;
-		} while (x++ != cropx1);
+			seg = MIN(left, view->width - mx);
+			sums[view->width + my] +=
+				puzzle_add_run_contrasts(sums + mx, run, seg);
+			run += seg;
+			left -= seg;
+			mx = 0U;
+			my++;
+		} while (left != 0U);
 	}
+}
 
-	// delete temporal readOnly copy.
-	free(readOnlyMaptr);
+/*
+ * Whether any pixel of the tile at (tx0, ty0) lands on a needed map
+ * position. Each tile column is one contiguous map run, crossing at most a
+ * few map rows; col_prefix[mx] counts the needed map columns before mx.
+ */
+static int puzzle_tile_needed(const PuzzleView * const view,
+	const unsigned char * const row_needed,
+	const unsigned int * const col_prefix,
+	const unsigned int tx0, const unsigned int ty0)
+{
+	const unsigned int tw = MIN(PUZZLE_LUMA_TILE, view->width - tx0);
+	const unsigned int th = MIN(PUZZLE_LUMA_TILE, view->height - ty0);
+	size_t offset;
+	unsigned int c;
+	unsigned int my, my0, my1;
+	unsigned int mx0, mx1;
 
+	for (c = 0U; c < tw; c++) {
+		offset = (size_t)(view->width - 1U - (tx0 + c)) * view->height +
+			(view->height - (ty0 + th));
+		my0 = (unsigned int)(offset / view->width);
+		my1 = (unsigned int)((offset + th - 1U) / view->width);
+		for (my = my0; my <= my1; my++) {
+			if (row_needed[my] == 0U) {
+				continue;
+			}
+			mx0 = my == my0 ? (unsigned int)(offset % view->width) : 0U;
+			mx1 = my == my1 ?
+				(unsigned int)((offset + th - 1U) % view->width) :
+				view->width - 1U;
+			if (col_prefix[mx1 + 1U] != col_prefix[mx0]) {
+				return 1;
+			}
+		}
+	}
+	return 0;
+}
 
-	view->width = cropx1 - cropx0 + 1U;
-	view->height = cropy1 - cropy0 + 1U;
-	view->sizeof_map = (size_t)view->width * (size_t)view->height;
-	if (view->width <= 0U || view->height <= 0U ||
-		SIZE_MAX / view->width < view->height) {
-		puzzle_err_bug(__FILE__, __LINE__);
+/*
+ * The block layout of the view, looked up in the context cache the first
+ * time it is needed and kept with the view, so that every pass over the
+ * same image shares a single lookup.
+ */
+static const PuzzleBlock *puzzle_view_blocks(PuzzleContext * const context,
+	PuzzleView * const view,
+	const unsigned int lambdas)
+{
+	if (view->blocks != NULL) {
+		return view->blocks;
+	}
+	if ((view->blocks = puzzle_scratch_calloc(view->scratch,
+		(size_t)lambdas * lambdas, sizeof *view->blocks)) == NULL) {
+		return NULL;
+	}
+	puzzle_get_blocks(context, view->blocks, view->width, view->height,
+		lambdas);
+
+	return view->blocks;
+}
+
+/*
+ * With autocrop off the view keeps the image size, so the sample squares
+ * are known before any pixel is converted. A pixel is needed exactly when
+ * its map column and its map row both fall inside a band of squares grown
+ * by the soft edge. The map is the image transposed, so those pixels are
+ * scattered along the image rows; the image is converted in the same tiles
+ * as the dense path, with the row kernels, skipping the tiles that hold no
+ * needed pixel. Levels outside the converted tiles stay 0.
+ */
+static int puzzle_getview_sparse(PuzzleContext * const context,
+	PuzzleView * const view,
+	const gdImagePtr gdimage,
+	const unsigned char * const lut,
+	const PuzzleLumaRowFn luma_row)
+{
+	const unsigned int lambdas = context->puzzle_lambdas;
+	const unsigned int tiles_x =
+		(view->width + PUZZLE_LUMA_TILE - 1U) / PUZZLE_LUMA_TILE;
+	const unsigned int tiles_y =
+		(view->height + PUZZLE_LUMA_TILE - 1U) / PUZZLE_LUMA_TILE;
+	const PuzzleBlock *blocks;
+	unsigned char *col_needed;
+	unsigned char *row_needed;
+	unsigned int *col_prefix;
+	size_t i;
+	unsigned int x0, y0, x1, y1;
+	unsigned int mx;
+
+	memset(view->map, 0, view->sizeof_map);
+	if ((col_needed = puzzle_scratch_calloc(view->scratch,
+		(size_t)view->width + view->height, sizeof *col_needed)) == NULL) {
+		return -1;
+	}
+	if ((col_prefix = puzzle_scratch_malloc(view->scratch,
+		((size_t)view->width + 1U) * sizeof *col_prefix)) == NULL) {
+		puzzle_scratch_free(view->scratch, col_needed);
+		return -1;
+	}
+	if ((blocks = puzzle_view_blocks(context, view, lambdas)) == NULL) {
+		puzzle_scratch_free(view->scratch, col_prefix);
+		puzzle_scratch_free(view->scratch, col_needed);
+		return -1;
 	}
+	row_needed = col_needed + view->width;
+	for (i = (size_t)0U; i < (size_t)lambdas * lambdas; i++) {
+		x0 = blocks[i].x > PUZZLE_PIXEL_FUZZ_SIZE ?
+			blocks[i].x - PUZZLE_PIXEL_FUZZ_SIZE : 0U;
+		y0 = blocks[i].y > PUZZLE_PIXEL_FUZZ_SIZE ?
+			blocks[i].y - PUZZLE_PIXEL_FUZZ_SIZE : 0U;
+		x1 = MIN(blocks[i].x + blocks[i].width + PUZZLE_PIXEL_FUZZ_SIZE,
+			view->width);
+		y1 = MIN(blocks[i].y + blocks[i].height + PUZZLE_PIXEL_FUZZ_SIZE,
+			view->height);
+		if (x0 < x1) {
+			memset(col_needed + x0, 1, x1 - x0);
+		}
+		if (y0 < y1) {
+			memset(row_needed + y0, 1, y1 - y0);
+		}
+	}
+	col_prefix[0] = 0U;
+	for (mx = 0U; mx < view->width; mx++) {
+		col_prefix[mx + 1U] = col_prefix[mx] + col_needed[mx];
+	}
+
+	//Paralized for loop (one thread for each column of tiles)
+	cilk_for(unsigned int tcol = 0U; tcol < tiles_x; tcol++)
+	{
+		unsigned int trow;
+
+		for (trow = 0U; trow < tiles_y; trow++) {
+			if (puzzle_tile_needed(view, row_needed, col_prefix,
+				tcol * PUZZLE_LUMA_TILE, trow * PUZZLE_LUMA_TILE) != 0) {
+				puzzle_getview_tile(view, gdimage, lut, luma_row,
+					tcol * PUZZLE_LUMA_TILE, trow * PUZZLE_LUMA_TILE, NULL);
+			}
+		}
+	}
+	puzzle_scratch_free(view->scratch, col_prefix);
+	puzzle_scratch_free(view->scratch, col_needed);
+
 	return 0;
 }
 
@@ -235,18 +622,26 @@ static int puzzle_getview_from_gdimage(PuzzleContext * const context,
 	PuzzleView * const view,
 	gdImagePtr gdimage)
 {
-	const unsigned int x0 = 0U, y0 = 0U;
 	unsigned int x1, y1;
-	unsigned char *maptr;
+	unsigned int tiles_x, tiles_y;
+	unsigned int bands;
+	unsigned long long *band_sums = NULL;
+	unsigned char lut[gdMaxColors];
+	PuzzleLumaRowFn luma_row = NULL;
+	size_t sizeof_sums;
+	size_t i;
+	unsigned int band;
 	int pixel;
 
 	view->map = NULL;
 	view->width = (unsigned int)gdImageSX(gdimage);
 	view->height = (unsigned int)gdImageSY(gdimage);
 	view->sizeof_map = (size_t)(view->width * view->height);
+	view->origin = (size_t)0U;
+	view->stride = (size_t)view->width;
 	if (view->width > context->puzzle_max_width ||
 		view->height > context->puzzle_max_height) {
-		return -1;
+		return PUZZLE_ERR_IMAGE_TOO_LARGE;
 	}
 	if (view->sizeof_map <= (size_t)0U ||
 		INT_MAX / view->width < view->height ||
@@ -260,53 +655,68 @@ static int puzzle_getview_from_gdimage(PuzzleContext * const context,
 	if (view->width <= 0U || view->height <= 0U) {
 		puzzle_err_bug(__FILE__, __LINE__);
 	}
-	if ((view->map = calloc(view->sizeof_map, sizeof *view->map)) == NULL) {
+	// every pixel is written below, except where the sparse path says so
+	if ((view->map = puzzle_scratch_malloc(view->scratch,
+		view->sizeof_map)) == NULL) {
 		return -1;
 	}
 	if (x1 > INT_MAX || y1 > INT_MAX) { /* GD uses "int" for coordinates */
 		puzzle_err_bug(__FILE__, __LINE__);
 	}
-	maptr = view->map;
-
-	if (gdImageTrueColor(gdimage) != 0)
-	{
-		//Paralized for loop (one thread for each pixel colum)
-		cilk_for(int x_temp = x1 + 1; x_temp != x0; x_temp--)
+	if (gdImageTrueColor(gdimage) != 0) {
+		luma_row = puzzle_luma_row_kernel();
+	}
+	else {
+		// at most gdMaxColors distinct levels: convert the palette once
+		for (pixel = 0; pixel < gdMaxColors; pixel++)
 		{
-			unsigned int x, y;
-			//Compute pointer value for each loop to avoid data races
-			unsigned char *maptr_tmp = maptr + (((x1 + 1) - x_temp)*(y1 + 1));
-
-			x = x_temp - 1;
-
-			for (int y_temp = y1 + 1; y_temp != y0; y_temp--)
-			{
-				y = y_temp - 1;
-				pixel = gdImageGetTrueColorPixel(gdimage, (int)x, (int)y);
-				*maptr_tmp++ = (unsigned char)((gdTrueColorGetRed(pixel) * 77 + gdTrueColorGetGreen(pixel) * 151 + gdTrueColorGetBlue(pixel) * 28 + 128) / 256);
-			}
+			lut[pixel] = (unsigned char)((gdimage->red[pixel] * 77 + gdimage->green[pixel] * 151 + gdimage->blue[pixel] * 28 + 128) / 256);
 		}
+	}
+	if (context->puzzle_enable_autocrop == 0) {
+		return puzzle_getview_sparse(context, view, gdimage, lut, luma_row);
+	}
+	tiles_x = (view->width + PUZZLE_LUMA_TILE - 1U) / PUZZLE_LUMA_TILE;
+	tiles_y = (view->height + PUZZLE_LUMA_TILE - 1U) / PUZZLE_LUMA_TILE;
 
+	// the autocrop contrasts are summed per band of tile columns, one band
+	// per worker, and folded together once every band is done
+	if (puzzle_view_alloc_contrasts(context, view) != 0) {
+		return -1;
+	}
+	bands = tiles_x;
+	sizeof_sums = (size_t)view->width + view->height;
+	if (view->col_contrasts != NULL) {
+		bands = MIN(tiles_x, (unsigned int)__cilkrts_get_nworkers());
+		if ((band_sums = puzzle_scratch_calloc(view->scratch,
+			bands * sizeof_sums, sizeof *band_sums)) == NULL) {
+			return -1;
+		}
 	}
-	else
-	{	
-		//Paralized for loop (one thread for each pixel colum)
-		cilk_for(int x_temp = x1 + 1; x_temp != x0; x_temp--)
-		{
-			unsigned int x, y;
-			//Compute pointer value for each loop to avoid data races
-			unsigned char *maptr_tmp = maptr + (((x1 + 1) - x_temp)*(y1 + 1));
 
-			x = x_temp - 1;
+	//Paralized for loop (one thread for each band of tile columns)
+	cilk_for(unsigned int b = 0U; b < bands; b++)
+	{
+		unsigned long long * const sums =
+			band_sums == NULL ? NULL : band_sums + b * sizeof_sums;
+		const unsigned int tcol1 = (b + 1U) * tiles_x / bands;
+		unsigned int tcol, trow;
 
-			for (int y_temp = y1 + 1; y_temp != y0; y_temp--)
-			{
-				y = y_temp - 1;
-				pixel = gdImagePalettePixel(gdimage, x, y);
-				*maptr_tmp++ = (unsigned char)((gdimage->red[pixel] * 77 + gdimage->green[pixel] * 151 + gdimage->blue[pixel] * 28 + 128) / 256);
+		for (tcol = b * tiles_x / bands; tcol < tcol1; tcol++) {
+			for (trow = 0U; trow < tiles_y; trow++) {
+				puzzle_getview_tile(view, gdimage, lut, luma_row,
+					tcol * PUZZLE_LUMA_TILE, trow * PUZZLE_LUMA_TILE, sums);
 			}
 		}
 	}
+	if (band_sums != NULL) {
+		for (band = 0U; band < bands; band++) {
+			for (i = (size_t)0U; i < sizeof_sums; i++) {
+				view->col_contrasts[i] += band_sums[band * sizeof_sums + i];
+			}
+		}
+		puzzle_scratch_free(view->scratch, band_sums);
+	}
 	return 0;
 }
 
@@ -384,21 +794,249 @@ static double puzzle_get_avglvl(const PuzzleView * const view,
 	return lvl / (double)(width * height);
 }
 
+/*
+ * A summed-area table covering what the soft-edged average of one block
+ * reads: the block grown by the fuzz on each side, clipped to the view.
+ */
+static void puzzle_init_integral(PuzzleIntegral * const integral,
+	const PuzzleView * const view,
+	const PuzzleBlock * const block)
+{
+	const unsigned int x1 = MIN(block->x + block->width +
+		(PUZZLE_PIXEL_FUZZ_SIZE - 1U), view->width - 1U);
+	const unsigned int y1 = MIN(block->y + block->height +
+		(PUZZLE_PIXEL_FUZZ_SIZE - 1U), view->height - 1U);
+
+	integral->x0 = block->x > PUZZLE_PIXEL_FUZZ_SIZE ?
+		block->x - PUZZLE_PIXEL_FUZZ_SIZE : 0U;
+	integral->y0 = block->y > PUZZLE_PIXEL_FUZZ_SIZE ?
+		block->y - PUZZLE_PIXEL_FUZZ_SIZE : 0U;
+	integral->width = x1 - integral->x0 + 1U;
+	integral->height = y1 - integral->y0 + 1U;
+	integral->view_width = view->width;
+	integral->view_height = view->height;
+	integral->sums = NULL;
+}
+
+/* Number of sums in the table, which has a zero row and column in front */
+static size_t puzzle_integral_size(const PuzzleIntegral * const integral)
+{
+	return ((size_t)integral->width + 1U) * ((size_t)integral->height + 1U);
+}
+
+/*
+ * The sums wrap around modulo 2^32, which keeps any rectangle sum exact
+ * as long as the rectangle itself sums to less than 2^32.
+ */
+static void puzzle_fill_integral(PuzzleIntegral * const integral,
+	const PuzzleView * const view,
+	unsigned int * const sums)
+{
+	const size_t width1 = (size_t)integral->width + 1U;
+	const unsigned char *row;
+	unsigned int *sumptr;
+	unsigned int row_sum;
+	unsigned int x, y;
+
+	integral->sums = sums;
+	memset(sums, 0, width1 * sizeof *sums);
+	sumptr = sums + width1;
+	y = 0U;
+	do {
+		row = &PUZZLE_VIEW_PIXEL(view, integral->x0, integral->y0 + y);
+		row_sum = 0U;
+		*sumptr++ = 0U;
+		x = 0U;
+		do {
+			row_sum += (unsigned int)row[x];
+			*sumptr = sumptr[-(ptrdiff_t)width1] + row_sum;
+			sumptr++;
+		} while (++x < integral->width);
+	} while (++y < integral->height);
+}
+
+/*
+ * Sum of the levels in [x0, x1] x [y0, y1], in view coordinates, clipped
+ * to the part of the view the table covers
+ */
+static unsigned int puzzle_integral_rect(const PuzzleIntegral * const integral,
+	int x0, int y0, int x1, int y1)
+{
+	const size_t width1 = (size_t)integral->width + 1U;
+	const unsigned int * const sums = integral->sums;
+
+	x0 = MAX(x0 - (int)integral->x0, 0);
+	y0 = MAX(y0 - (int)integral->y0, 0);
+	x1 = MIN(x1 - (int)integral->x0, (int)integral->width - 1);
+	y1 = MIN(y1 - (int)integral->y0, (int)integral->height - 1);
+	if (x0 > x1 || y0 > y1) {
+		return 0U;
+	}
+	return sums[(size_t)(y1 + 1) * width1 + (size_t)(x1 + 1)] -
+		sums[(size_t)y0 * width1 + (size_t)(x1 + 1)] -
+		sums[(size_t)(y1 + 1) * width1 + (size_t)x0] +
+		sums[(size_t)y0 * width1 + (size_t)x0];
+}
+
+/*
+ * Close to puzzle_get_avglvl(), in O(1) once the table is built. Every
+ * pixel contributes its 3x3 neighborhood sum divided by the number of
+ * neighbors that are inside the view. That number only drops on the first
+ * and last row and column, so the block is split into at most 3 x 3 parts
+ * sharing the same divisor, and the neighborhood sums of each part are
+ * nine shifted rectangle sums. The divisions happen per part instead of
+ * per pixel, so the last bits of the level can differ from the pixel by
+ * pixel average, which is why this is opt-in.
+ */
+static double puzzle_get_avglvl_integral(const PuzzleIntegral * const integral,
+	const unsigned int x, const unsigned int y,
+	const unsigned int width,
+	const unsigned int height)
+{
+	const unsigned int view_width = integral->view_width;
+	const unsigned int view_height = integral->view_height;
+	const unsigned int xlimit = x + width - 1U;
+	const unsigned int ylimit = y + height - 1U;
+	unsigned int xa[3], xb[3], ya[3], yb[3];
+	unsigned int xn = 0U, yn = 0U;
+	unsigned int i, j;
+	unsigned int cx, cy;
+	unsigned long long part;
+	int dx, dy;
+	double lvl = 0.0;
+
+	if (width <= 0U || height <= 0U || xlimit < x || ylimit < y ||
+		xlimit >= view_width || ylimit >= view_height) {
+		puzzle_err_bug(__FILE__, __LINE__);
+	}
+	if (x == 0U) {
+		xa[xn] = xb[xn] = 0U;
+		xn++;
+	}
+	if (view_width >= 2U &&
+		MAX(x, 1U) <= MIN(xlimit, view_width - 2U)) {
+		xa[xn] = MAX(x, 1U);
+		xb[xn] = MIN(xlimit, view_width - 2U);
+		xn++;
+	}
+	if (xlimit == view_width - 1U && view_width > 1U) {
+		xa[xn] = xb[xn] = xlimit;
+		xn++;
+	}
+	if (y == 0U) {
+		ya[yn] = yb[yn] = 0U;
+		yn++;
+	}
+	if (view_height >= 2U &&
+		MAX(y, 1U) <= MIN(ylimit, view_height - 2U)) {
+		ya[yn] = MAX(y, 1U);
+		yb[yn] = MIN(ylimit, view_height - 2U);
+		yn++;
+	}
+	if (ylimit == view_height - 1U && view_height > 1U) {
+		ya[yn] = yb[yn] = ylimit;
+		yn++;
+	}
+	for (i = 0U; i < xn; i++) {
+		cx = MIN(xa[i] + 1U, view_width - 1U) -
+			(xa[i] > 0U ? xa[i] - 1U : 0U) + 1U;
+		for (j = 0U; j < yn; j++) {
+			cy = MIN(ya[j] + 1U, view_height - 1U) -
+				(ya[j] > 0U ? ya[j] - 1U : 0U) + 1U;
+			part = 0ULL;
+			for (dx = -1; dx <= 1; dx++) {
+				for (dy = -1; dy <= 1; dy++) {
+					part += puzzle_integral_rect(integral,
+						(int)xa[i] + dx, (int)ya[j] + dy,
+						(int)xb[i] + dx, (int)yb[j] + dy);
+				}
+			}
+			lvl += (double)part / (double)(cx * cy);
+		}
+	}
+	return lvl / (double)(width * height);
+}
+
+/*
+ * Lays out one summed-area table per block in a single buffer, or leaves
+ * *tables NULL when some block could sum past 2^32 or the tables would not
+ * fit in memory, in which case every block keeps the pixel by pixel average.
+ */
+static int puzzle_alloc_integrals(const PuzzleView * const view,
+	const PuzzleBlock * const blocks,
+	const size_t nblocks,
+	size_t ** const table_offsets,
+	unsigned int ** const tables)
+{
+	PuzzleIntegral integral;
+	size_t *offsets;
+	size_t size;
+	size_t i;
+
+	*table_offsets = NULL;
+	*tables = NULL;
+	for (i = (size_t)0U; i < nblocks; i++) {
+		if (blocks[i].width > 0xffffU || blocks[i].height > 0xffffU ||
+			blocks[i].width * blocks[i].height > UINT_MAX / 255U) {
+			return 0;
+		}
+	}
+	if ((offsets = puzzle_scratch_calloc(view->scratch,
+		nblocks + 1U, sizeof *offsets)) == NULL) {
+		return -1;
+	}
+	for (i = (size_t)0U; i < nblocks; i++) {
+		puzzle_init_integral(&integral, view, &blocks[i]);
+		size = puzzle_integral_size(&integral);
+		if (SIZE_MAX / sizeof **tables - offsets[i] < size) {
+			puzzle_scratch_free(view->scratch, offsets);
+			return 0;
+		}
+		offsets[i + 1U] = offsets[i] + size;
+	}
+	if ((*tables = puzzle_scratch_malloc(view->scratch,
+		offsets[nblocks] * sizeof **tables)) == NULL) {
+		puzzle_scratch_free(view->scratch, offsets);
+		return -1;
+	}
+	*table_offsets = offsets;
+
+	return 0;
+}
+
+/* table is NULL for the pixel by pixel average */
+static double puzzle_get_block_avglvl(const PuzzleView * const view,
+	const PuzzleBlock * const block,
+	unsigned int * const table)
+{
+	PuzzleIntegral integral;
+
+	if (block->width <= 0U || block->height <= 0U) {
+		return 0.0;
+	}
+	if (table != NULL) {
+		puzzle_init_integral(&integral, view, block);
+		puzzle_fill_integral(&integral, view, table);
+		return puzzle_get_avglvl_integral(&integral, block->x, block->y,
+			block->width, block->height);
+	}
+	return puzzle_get_avglvl(view, block->x, block->y,
+		block->width, block->height);
+}
+
+/*
+ * Every block is an independent task: it only reads the view, and writes
+ * its own level and its own summed-area table, so the levels do not depend
+ * on scheduling.
+ */
 static int puzzle_fill_avglgls(PuzzleContext * const context,
 	PuzzleAvgLvls * const avglvls,
-	const PuzzleView * const view,
+	PuzzleView * const view,
 	const unsigned int lambdas)
 {
-	double width = (double)view->width;
-	double height = (double)view->height;
-	double xshift, yshift;
-	double x, y;
-	unsigned int p;
-	unsigned int lx, ly;
-	unsigned int xd, yd;
-	unsigned int px, py;
-	unsigned int lwidth, lheight;
-	double avglvl;
+	const PuzzleBlock *blocks;
+	size_t *table_offsets = NULL;
+	unsigned int *tables = NULL;
 
 	avglvls->lambdas = lambdas;
 	avglvls->sizeof_lvls = (size_t)lambdas * lambdas;
@@ -406,64 +1044,60 @@ static int puzzle_fill_avglgls(PuzzleContext * const context,
 		(unsigned int)avglvls->sizeof_lvls != avglvls->sizeof_lvls) {
 		puzzle_err_bug(__FILE__, __LINE__);
 	}
-	if ((avglvls->lvls = calloc(avglvls->sizeof_lvls,
-		sizeof *avglvls->lvls)) == NULL) {
+	if ((avglvls->lvls = puzzle_scratch_calloc(view->scratch,
+		avglvls->sizeof_lvls, sizeof *avglvls->lvls)) == NULL) {
 		return -1;
 	}
-	xshift = (width -
-		(width * (double)lambdas / (double)SUCC(lambdas))) / 2.0;
-	yshift = (height -
-		(height * (double)lambdas / (double)SUCC(lambdas))) / 2.0;
-	p = (unsigned int)round(MIN(width, height) /
-		(SUCC(lambdas) * context->puzzle_p_ratio));
-	if (p < PUZZLE_MIN_P) {
-		p = PUZZLE_MIN_P;
+	if ((blocks = puzzle_view_blocks(context, view, lambdas)) == NULL) {
+		return -1;
 	}
-	lx = 0U;
-	do {
-		ly = 0U;
-		do {
-			x = xshift + (double)lx * PRED(width) / SUCC(lambdas);
-			y = yshift + (double)ly * PRED(height) / SUCC(lambdas);
-			lwidth = (unsigned int)round
-				(xshift + (double)SUCC(lx) * PRED(width) /
-				(double)SUCC(lambdas) - x);
-			lheight = (unsigned int)round
-				(yshift + (double)SUCC(ly) * PRED(height) /
-				(double)SUCC(lambdas) - y);
-			if (p < lwidth) {
-				xd = (unsigned int)round(x + (lwidth - p) / 2.0);
-			}
-			else {
-				xd = (unsigned int)round(x);
-			}
-			if (p < lheight) {
-				yd = (unsigned int)round(y + (lheight - p) / 2.0);
-			}
-			else {
-				yd = (unsigned int)round(y);
-			}
-			if (view->width - xd < p) {
-				px = 1U;
-			}
-			else {
-				px = p;
-			}
-			if (view->height - yd < p) {
-				py = 1U;
-			}
-			else {
-				py = p;
-			}
-			if (px > 0U && py > 0U) {
-				avglvl = puzzle_get_avglvl(view, xd, yd, px, py);
-			}
-			else {
-				avglvl = 0.0;
-			}
-			PUZZLE_AVGLVL(avglvls, lx, ly) = avglvl;
-		} while (++ly < lambdas);
-	} while (++lx < lambdas);
+	if (context->puzzle_enable_avglvls_integral != 0 &&
+		puzzle_alloc_integrals(view, blocks, avglvls->sizeof_lvls,
+		&table_offsets, &tables) != 0) {
+		return -1;
+	}
+	//Paralized for loop (one task for each block)
+	cilk_for(unsigned int block = 0U; block < (unsigned int)avglvls->sizeof_lvls; block++)
+	{
+		avglvls->lvls[block] = puzzle_get_block_avglvl(view,
+			&blocks[block],
+			tables == NULL ? NULL : tables + table_offsets[block]);
+	}
+	puzzle_scratch_free(view->scratch, tables);
+	puzzle_scratch_free(view->scratch, table_offsets);
+
+	return 0;
+}
+
+/*
+ * The serial pass the parallel one replaced, kept as the reference of the
+ * validation mode: the layout is computed afresh, bypassing the cache, and
+ * the blocks are averaged pixel by pixel, one after the other.
+ */
+static int puzzle_fill_avglgls_serial(PuzzleContext * const context,
+	PuzzleAvgLvls * const avglvls,
+	const PuzzleView * const view,
+	const unsigned int lambdas)
+{
+	PuzzleBlock *blocks;
+	size_t i;
+
+	avglvls->lambdas = lambdas;
+	avglvls->sizeof_lvls = (size_t)lambdas * lambdas;
+	if ((avglvls->lvls = puzzle_scratch_calloc(view->scratch,
+		avglvls->sizeof_lvls, sizeof *avglvls->lvls)) == NULL) {
+		return -1;
+	}
+	if ((blocks = puzzle_scratch_calloc(view->scratch,
+		avglvls->sizeof_lvls, sizeof *blocks)) == NULL) {
+		return -1;
+	}
+	puzzle_compute_blocks(context, blocks, view->width, view->height,
+		lambdas);
+	for (i = (size_t)0U; i < avglvls->sizeof_lvls; i++) {
+		avglvls->lvls[i] = puzzle_get_block_avglvl(view, &blocks[i], NULL);
+	}
+	puzzle_scratch_free(view->scratch, blocks);
 
 	return 0;
 }
@@ -524,8 +1158,107 @@ static unsigned int puzzle_add_neighbors(double ** const vecur,
 	return neighbors;
 }
 
-static int puzzle_fill_dvec(PuzzleDvec * const dvec,
+/*
+ * Away from the grid borders every center has all 8 neighbors, at fixed
+ * offsets in the same order puzzle_add_neighbors() visits them, so the
+ * run of interior centers of one grid column is a straight loop.
+ */
+static inline double *puzzle_add_interior_neighbors(double *vecur,
+	const double * const lvls,
+	const unsigned int lambdas,
+	const unsigned int lx)
+{
+	const int l = (int)lambdas;
+	const int offsets[PUZZLE_NEIGHBORS] = {
+		-1 - l, -1, -1 + l, -l, l, 1 - l, 1, 1 + l
+	};
+	const double *center;
+	unsigned int ly;
+	unsigned int k;
+
+	for (ly = 1U; ly < lambdas - 1U; ly++) {
+		center = lvls + lambdas * ly + lx;
+		for (k = 0U; k < PUZZLE_NEIGHBORS; k++) {
+			*vecur++ = *center - center[offsets[k]];
+		}
+	}
+	return vecur;
+}
+
+/* The dvec entries of the centers of grid column lx, top to bottom */
+static inline double *puzzle_add_column_neighbors(double *vecur,
+	const PuzzleAvgLvls * const avglvls,
+	const unsigned int lambdas,
+	const unsigned int lx)
+{
+	unsigned int ly;
+
+	if (lx == 0U || lx == lambdas - 1U) {
+		for (ly = 0U; ly < lambdas; ly++) {
+			(void)puzzle_add_neighbors(&vecur, PUZZLE_NEIGHBORS,
+				avglvls, lx, ly);
+		}
+		return vecur;
+	}
+	(void)puzzle_add_neighbors(&vecur, PUZZLE_NEIGHBORS, avglvls, lx, 0U);
+	vecur = puzzle_add_interior_neighbors(vecur, avglvls->lvls, lambdas, lx);
+	(void)puzzle_add_neighbors(&vecur, PUZZLE_NEIGHBORS,
+		avglvls, lx, lambdas - 1U);
+
+	return vecur;
+}
+
+/*
+ * The dvec entries of one grid column, for callers that never build the
+ * dvec; diffs must hold lambdas * PUZZLE_NEIGHBORS values.
+ */
+unsigned int puzzle_get_column_neighbors(const PuzzleAvgLvls * const avglvls,
+	const unsigned int lx,
+	double * const diffs)
+{
+	return (unsigned int)(puzzle_add_column_neighbors(diffs, avglvls,
+		avglvls->lambdas, lx) - diffs);
+}
+
+/*
+ * Same output as the generic loop in puzzle_fill_dvec(). Called with a
+ * constant lambdas, so the interior runs get fixed trip counts and
+ * offsets the compiler can unroll and vectorize; only the border centers
+ * go through puzzle_add_neighbors().
+ */
+static inline double *puzzle_fill_dvec_lambdas(double *vecur,
+	const PuzzleAvgLvls * const avglvls,
+	const unsigned int lambdas)
+{
+	unsigned int lx;
+
+	for (lx = 0U; lx < lambdas; lx++) {
+		vecur = puzzle_add_column_neighbors(vecur, avglvls, lambdas, lx);
+	}
+	return vecur;
+}
+
+static double *puzzle_fill_dvec_7(double * const vecur,
+	const PuzzleAvgLvls * const avglvls)
+{
+	return puzzle_fill_dvec_lambdas(vecur, avglvls, 7U);
+}
+
+static double *puzzle_fill_dvec_9(double * const vecur,
+	const PuzzleAvgLvls * const avglvls)
+{
+	return puzzle_fill_dvec_lambdas(vecur, avglvls, 9U);
+}
+
+static double *puzzle_fill_dvec_11(double * const vecur,
 	const PuzzleAvgLvls * const avglvls)
+{
+	return puzzle_fill_dvec_lambdas(vecur, avglvls, 11U);
+}
+
+static int puzzle_fill_dvec(PuzzleDvec * const dvec,
+	const PuzzleAvgLvls * const avglvls,
+	PuzzleScratch * const scratch)
 {
 	unsigned int lambdas;
 	unsigned int lx, ly;
@@ -539,46 +1272,207 @@ static int puzzle_fill_dvec(PuzzleDvec * const dvec,
 		(unsigned int)dvec->sizeof_vec != dvec->sizeof_vec) {
 		puzzle_err_bug(__FILE__, __LINE__);
 	}
-	if ((dvec->vec = calloc(dvec->sizeof_vec, sizeof *dvec->vec)) == NULL) {
+	if ((dvec->vec = puzzle_scratch_calloc(scratch,
+		dvec->sizeof_vec, sizeof *dvec->vec)) == NULL) {
 		return -1;
 	}
 	vecur = dvec->vec;
-	lx = 0U;
-	do {
-		ly = 0U;
+	switch (lambdas) {
+	case 7U:
+		vecur = puzzle_fill_dvec_7(vecur, avglvls);
+		break;
+	case 9U:
+		vecur = puzzle_fill_dvec_9(vecur, avglvls);
+		break;
+	case 11U:
+		vecur = puzzle_fill_dvec_11(vecur, avglvls);
+		break;
+	default:
+		lx = 0U;
 		do {
-			(void)puzzle_add_neighbors(&vecur, PUZZLE_NEIGHBORS,
-				avglvls, lx, ly);
-		} while (++ly < lambdas);
-	} while (++lx < lambdas);
+			ly = 0U;
+			do {
+				(void)puzzle_add_neighbors(&vecur, PUZZLE_NEIGHBORS,
+					avglvls, lx, ly);
+			} while (++ly < lambdas);
+		} while (++lx < lambdas);
+	}
 	dvec->sizeof_compressed_vec = (size_t)(vecur - dvec->vec);
 
 	return 0;
 }
 
-int puzzle_fill_dvec_from_file(PuzzleContext * const context,
+/*
+ * Validation mode: the cvec these levels give must be the one the serial
+ * reference pass gives through its dvec, or PUZZLE_ERR_AVGLVLS_MISMATCH
+ * is returned.
+ */
+static int puzzle_check_avglvls(PuzzleContext * const context,
+	const PuzzleAvgLvls * const avglvls,
+	const PuzzleView * const view)
+{
+	PuzzleAvgLvls serial_avglvls;
+	PuzzleDvec serial_dvec;
+	PuzzleCvec serial_cvec;
+	PuzzleCvec cvec;
+	int ret = -1;
+
+	puzzle_init_avglvls(&serial_avglvls);
+	puzzle_init_dvec(context, &serial_dvec);
+	puzzle_init_cvec(context, &serial_cvec);
+	puzzle_init_cvec(context, &cvec);
+	if (puzzle_fill_avglgls_serial(context, &serial_avglvls, view,
+		avglvls->lambdas) != 0 ||
+		puzzle_fill_dvec(&serial_dvec, &serial_avglvls, NULL) != 0 ||
+		puzzle_fill_cvec_from_dvec(context, &serial_cvec,
+		&serial_dvec) != 0 ||
+		puzzle_fill_cvec_from_avglvls(context, &cvec, avglvls, NULL) != 0) {
+		goto out;
+	}
+	ret = 0;
+	if (cvec.sizeof_vec != serial_cvec.sizeof_vec ||
+		memcmp(cvec.vec, serial_cvec.vec, cvec.sizeof_vec) != 0) {
+		ret = PUZZLE_ERR_AVGLVLS_MISMATCH;
+	}
+out:
+	puzzle_free_cvec(context, &cvec);
+	puzzle_free_cvec(context, &serial_cvec);
+	puzzle_free_dvec(context, &serial_dvec);
+	puzzle_free_avglvls(&serial_avglvls, view->scratch);
+
+	return ret;
+}
+
+/*
+ * Takes ownership of view, which is released before returning.
+ * Fills dvec, or when dvec is NULL quantizes the levels straight into cvec.
+ */
+static int puzzle_fill_vec_from_view(PuzzleContext * const context,
 	PuzzleDvec * const dvec,
-	const char * const file)
+	PuzzleCvec * const cvec,
+	PuzzleView * const view)
+{
+	PuzzleAvgLvls avglvls;
+	int ret = 0;
+
+	puzzle_init_avglvls(&avglvls);
+	if (context->puzzle_enable_autocrop != 0 &&
+		(ret = puzzle_autocrop_view(context, view)) < 0) {
+		goto out;
+	}
+	if ((ret = puzzle_fill_avglgls(context, &avglvls,
+		view, context->puzzle_lambdas)) != 0) {
+		goto out;
+	}
+	if (context->puzzle_enable_avglvls_validation != 0 &&
+		(ret = puzzle_check_avglvls(context, &avglvls, view)) != 0) {
+		goto out;
+	}
+	if (dvec != NULL) {
+		ret = puzzle_fill_dvec(dvec, &avglvls, view->scratch);
+	}
+	else {
+		ret = puzzle_fill_cvec_from_avglvls(context, cvec, &avglvls,
+			view->scratch);
+	}
+out:
+	puzzle_free_avglvls(&avglvls, view->scratch);
+	puzzle_free_view(view);
+
+	return ret;
+}
+
+/* Takes ownership of gdimage, which is released as soon as the view is built */
+static int puzzle_fill_vec_from_gdimage(PuzzleContext * const context,
+	PuzzleDvec * const dvec,
+	PuzzleCvec * const cvec,
+	gdImagePtr gdimage,
+	PuzzleScratch * const scratch)
+{
+	PuzzleView view;
+	int ret;
+
+	puzzle_init_view(&view);
+	view.scratch = scratch;
+	ret = puzzle_getview_from_gdimage(context, &view, gdimage);
+	gdImageDestroy(gdimage);
+	if (ret != 0) {
+		puzzle_free_view(&view);
+		return ret;
+	}
+	return puzzle_fill_vec_from_view(context, dvec, cvec, &view);
+}
+
+/*
+ * Fills exactly one of dvec and cvec. With a scratch, every buffer
+ * including the result comes from it, so the result must not be passed
+ * to puzzle_free_dvec() or puzzle_free_cvec().
+ */
+int puzzle_fill_vec_from_file(PuzzleContext * const context,
+	PuzzleDvec * const dvec,
+	PuzzleCvec * const cvec,
+	const char * const file,
+	PuzzleScratch * const scratch)
 {
 	gdImagePtr gdimage = NULL;
 	FILE *fp;
-	PuzzleView view;
-	PuzzleAvgLvls avglvls;
+	PuzzleProbe probe;
 	PuzzleImageTypeCode image_type_code;
-	int ret = 0;
+	PuzzleView view;
+	int ret = 1;
 
 	if (context->magic != PUZZLE_CONTEXT_MAGIC) {
 		puzzle_err_bug(__FILE__, __LINE__);
 	}
-	puzzle_init_view(&view);
-	puzzle_init_avglvls(&avglvls);
-	puzzle_init_dvec(context, dvec);
+	if (dvec != NULL) {
+		puzzle_init_dvec(context, dvec);
+	}
+	else {
+		puzzle_init_cvec(context, cvec);
+	}
 	if ((fp = fopen(file, "rb")) == NULL) {
 		return -1;
 	}
 	image_type_code = puzzle_get_image_type_from_fp(fp);
+	probe.fp = fp;
+	probe.buf = NULL;
+	probe.len = (size_t)0U;
+	if (puzzle_probe_too_large(context, &probe, image_type_code) != 0) {
+		(void)fclose(fp);
+		return PUZZLE_ERR_IMAGE_TOO_LARGE;
+	}
+	rewind(fp);
+
+	/* decoders that build the luma view without a gdImage */
+	puzzle_init_view(&view);
+	view.scratch = scratch;
+#ifdef HAVE_JPEGLIB_H
+	if (image_type_code == PUZZLE_IMAGE_TYPE_JPEG &&
+		context->puzzle_enable_jpeg_luma != 0) {
+		ret = puzzle_jpeg_getview_from_fp(context, &view, fp);
+	}
+#endif
+	if (ret <= 0) {
+		(void)fclose(fp);
+		if (ret < 0) {
+			puzzle_free_view(&view);
+			return ret;
+		}
+		return puzzle_fill_vec_from_view(context, dvec, cvec, &view);
+	}
+	rewind(fp);
+
 	switch (image_type_code) {
 	case PUZZLE_IMAGE_TYPE_JPEG:
+#ifdef HAVE_JPEGLIB_H
+		if (context->puzzle_jpeg_scaling_min_p > 0U) {
+			if ((ret = puzzle_jpeg_create_gdimage_from_fp(context,
+				&gdimage, fp)) <= 0) {
+				break;
+			}
+			rewind(fp);
+		}
+#endif
 		gdimage = gdImageCreateFromJpeg(fp);
 		break;
 	case PUZZLE_IMAGE_TYPE_PNG:
@@ -592,27 +1486,105 @@ int puzzle_fill_dvec_from_file(PuzzleContext * const context,
 	}
 	(void)fclose(fp);
 	if (gdimage == NULL) {
+		return ret == PUZZLE_ERR_IMAGE_TOO_LARGE ? ret : -1;
+	}
+	return puzzle_fill_vec_from_gdimage(context, dvec, cvec, gdimage,
+		scratch);
+}
+
+int puzzle_fill_dvec_from_file(PuzzleContext * const context,
+	PuzzleDvec * const dvec,
+	const char * const file)
+{
+	return puzzle_fill_vec_from_file(context, dvec, NULL, file, NULL);
+}
+
+/* Same contract as puzzle_fill_vec_from_file() */
+int puzzle_fill_vec_from_memory(PuzzleContext * const context,
+	PuzzleDvec * const dvec,
+	PuzzleCvec * const cvec,
+	const void * const buf,
+	const size_t len,
+	PuzzleScratch * const scratch)
+{
+	gdImagePtr gdimage = NULL;
+	PuzzleProbe probe;
+	PuzzleImageTypeCode image_type_code;
+	/* gd takes a non-const pointer but only ever reads through it */
+	void * const data = (void *)buf;
+	PuzzleView view;
+	int ret = 1;
+
+	if (context->magic != PUZZLE_CONTEXT_MAGIC) {
+		puzzle_err_bug(__FILE__, __LINE__);
+	}
+	if (dvec != NULL) {
+		puzzle_init_dvec(context, dvec);
+	}
+	else {
+		puzzle_init_cvec(context, cvec);
+	}
+	if (buf == NULL || len > (size_t)INT_MAX) {
 		return -1;
 	}
-	ret = puzzle_getview_from_gdimage(context, &view, gdimage);
-	gdImageDestroy(gdimage);
-	if (ret != 0) {
-		goto out;
+	image_type_code = puzzle_get_image_type_from_header(buf, len);
+	probe.fp = NULL;
+	probe.buf = buf;
+	probe.len = len;
+	if (puzzle_probe_too_large(context, &probe, image_type_code) != 0) {
+		return PUZZLE_ERR_IMAGE_TOO_LARGE;
 	}
-	if (context->puzzle_enable_autocrop != 0 &&
-		(ret = puzzle_autocrop_view(context, &view)) < 0) {
-		goto out;
+
+	/* decoders that build the luma view without a gdImage */
+	puzzle_init_view(&view);
+	view.scratch = scratch;
+#ifdef HAVE_JPEGLIB_H
+	if (image_type_code == PUZZLE_IMAGE_TYPE_JPEG &&
+		context->puzzle_enable_jpeg_luma != 0) {
+		ret = puzzle_jpeg_getview_from_memory(context, &view, buf, len);
 	}
-	if ((ret = puzzle_fill_avglgls(context, &avglvls,
-		&view, context->puzzle_lambdas)) != 0) {
-		goto out;
+#endif
+	if (ret <= 0) {
+		if (ret < 0) {
+			puzzle_free_view(&view);
+			return ret;
+		}
+		return puzzle_fill_vec_from_view(context, dvec, cvec, &view);
 	}
-	ret = puzzle_fill_dvec(dvec, &avglvls);
-out:
-	puzzle_free_view(&view);
-	puzzle_free_avglvls(&avglvls);
 
-	return ret;
+	switch (image_type_code) {
+	case PUZZLE_IMAGE_TYPE_JPEG:
+#ifdef HAVE_JPEGLIB_H
+		if (context->puzzle_jpeg_scaling_min_p > 0U &&
+			(ret = puzzle_jpeg_create_gdimage_from_memory(context,
+			&gdimage, buf, len)) <= 0) {
+			break;
+		}
+#endif
+		gdimage = gdImageCreateFromJpegPtr((int)len, data);
+		break;
+	case PUZZLE_IMAGE_TYPE_PNG:
+		gdimage = gdImageCreateFromPngPtr((int)len, data);
+		break;
+	case PUZZLE_IMAGE_TYPE_GIF:
+		gdimage = gdImageCreateFromGifPtr((int)len, data);
+		break;
+	default:
+		gdimage = NULL;
+	}
+	if (gdimage == NULL) {
+		return ret == PUZZLE_ERR_IMAGE_TOO_LARGE ? ret : -1;
+	}
+	return puzzle_fill_vec_from_gdimage(context, dvec, cvec, gdimage,
+		scratch);
+}
+
+int puzzle_fill_dvec_from_memory(PuzzleContext * const context,
+	PuzzleDvec * const dvec,
+	const void * const buf,
+	const size_t len)
+{
+	return puzzle_fill_vec_from_memory(context, dvec, NULL, buf, len, NULL);
 }
 
 int puzzle_dump_dvec(PuzzleContext * const context,
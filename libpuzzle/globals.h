@@ -21,6 +21,14 @@ GLOBAL(PuzzleContext puzzle_global_context,
         /* double puzzle_max_cropping_ratio */
         PUZZLE_DEFAULT_MAX_CROPPING_RATIO _COMA_
         /* int puzzle_enable_autocrop */ PUZZLE_DEFAULT_ENABLE_AUTOCROP _COMA_
+        /* unsigned int puzzle_jpeg_scaling_min_p */
+        PUZZLE_DEFAULT_JPEG_SCALING_MIN_P _COMA_
+        /* int puzzle_enable_jpeg_luma */ PUZZLE_DEFAULT_ENABLE_JPEG_LUMA _COMA_
+        /* int puzzle_enable_avglvls_integral */
+        PUZZLE_DEFAULT_ENABLE_AVGLVLS_INTEGRAL _COMA_
+        /* int puzzle_enable_avglvls_validation */
+        PUZZLE_DEFAULT_ENABLE_AVGLVLS_VALIDATION _COMA_
+        /* struct PuzzleBlockCache_ *puzzle_block_cache */ NULL _COMA_
         /* unsigned long magic */ PUZZLE_CONTEXT_MAGIC _COMA_        
 });
 #endif
@@ -0,0 +1,261 @@
+#include "puzzle_common.h"
+#include "puzzle_p.h"
+#include "puzzle.h"
+
+#ifdef HAVE_JPEGLIB_H
+#include <setjmp.h>
+#include <jpeglib.h>
+
+typedef struct PuzzleJpegErrorMgr_ {
+	struct jpeg_error_mgr pub;
+	jmp_buf jmpbuf;
+} PuzzleJpegErrorMgr;
+
+static void puzzle_jpeg_error_exit(j_common_ptr cinfo)
+{
+	PuzzleJpegErrorMgr * const err = (PuzzleJpegErrorMgr *)cinfo->err;
+
+	longjmp(err->jmpbuf, 1);
+}
+
+static void puzzle_jpeg_output_message(j_common_ptr cinfo)
+{
+	(void)cinfo;
+}
+
+/*
+ * Pick the largest libjpeg reduction (1/8, 1/4, 1/2) that still leaves
+ * at least puzzle_jpeg_scaling_min_p pixels on each side of the sample
+ * squares puzzle_fill_avglgls() will read.
+ */
+static unsigned int puzzle_jpeg_scale_denom(PuzzleContext * const context,
+	const unsigned int width,
+	const unsigned int height)
+{
+	const double min_p = (double)context->puzzle_jpeg_scaling_min_p;
+	unsigned int denom = 8U;
+	double side;
+
+	if (context->puzzle_jpeg_scaling_min_p <= 0U) {
+		return 1U;
+	}
+	do {
+		side = (double)((MIN(width, height) + denom - 1U) / denom);
+		if (round(side / (SUCC(context->puzzle_lambdas) *
+			context->puzzle_p_ratio)) >= min_p) {
+			return denom;
+		}
+	} while ((denom /= 2U) > 1U);
+
+	return 1U;
+}
+
+/*
+ * Reads the header, checks the size limits and configures scaling and the
+ * output color space. With want_luma, streams that libjpeg can reduce to
+ * luma on its own get JCS_GRAYSCALE output; RGB streams stay JCS_RGB.
+ * Returns 1 when the color space should be left to gd.
+ */
+static int puzzle_jpeg_start(PuzzleContext * const context,
+	j_decompress_ptr cinfo,
+	const int want_luma)
+{
+	(void)jpeg_read_header(cinfo, TRUE);
+	if (cinfo->image_width > context->puzzle_max_width ||
+		cinfo->image_height > context->puzzle_max_height) {
+		return PUZZLE_ERR_IMAGE_TOO_LARGE;
+	}
+	switch (cinfo->jpeg_color_space) {
+	case JCS_GRAYSCALE:
+		cinfo->out_color_space = JCS_GRAYSCALE;
+		break;
+	case JCS_YCbCr:
+		cinfo->out_color_space = want_luma != 0 ? JCS_GRAYSCALE : JCS_RGB;
+		break;
+	case JCS_RGB:
+		cinfo->out_color_space = JCS_RGB;
+		break;
+	default:
+		/* CMYK and friends are left to gd */
+		return 1;
+	}
+	cinfo->scale_num = 1U;
+	cinfo->scale_denom = puzzle_jpeg_scale_denom(context,
+		cinfo->image_width, cinfo->image_height);
+	(void)jpeg_start_decompress(cinfo);
+	if (cinfo->output_width <= 0U || cinfo->output_height <= 0U ||
+		cinfo->output_width > INT_MAX || cinfo->output_height > INT_MAX ||
+		(cinfo->output_components != 1 && cinfo->output_components != 3)) {
+		puzzle_err_bug(__FILE__, __LINE__);
+	}
+	return 0;
+}
+
+static void puzzle_jpeg_read_gdimage(j_decompress_ptr cinfo,
+	gdImagePtr gdimage)
+{
+	JSAMPARRAY row;
+	const JSAMPLE *sample;
+	int *tpixel;
+	unsigned int x;
+
+	row = (*cinfo->mem->alloc_sarray)((j_common_ptr)cinfo, JPOOL_IMAGE,
+		cinfo->output_width * (JDIMENSION)cinfo->output_components, 1U);
+	while (cinfo->output_scanline < cinfo->output_height) {
+		tpixel = gdimage->tpixels[cinfo->output_scanline];
+		(void)jpeg_read_scanlines(cinfo, row, 1U);
+		sample = row[0];
+		x = cinfo->output_width;
+		if (cinfo->output_components == 3) {
+			do {
+				*tpixel++ = gdTrueColor(sample[0], sample[1], sample[2]);
+				sample += 3;
+			} while (--x != 0U);
+		}
+		else {
+			do {
+				*tpixel++ = gdTrueColor(*sample, *sample, *sample);
+				sample++;
+			} while (--x != 0U);
+		}
+	}
+}
+
+/*
+ * Writes luma straight into the view, in the same column-major, mirrored
+ * order puzzle_getview_from_gdimage() produces. RGB rows are reduced to
+ * luma in place before being stored.
+ */
+static void puzzle_jpeg_read_view(j_decompress_ptr cinfo,
+	PuzzleView * const view)
+{
+	JSAMPARRAY row;
+	const JSAMPLE *sample;
+	JSAMPLE *luma;
+	unsigned int x;
+	unsigned int y;
+
+	row = (*cinfo->mem->alloc_sarray)((j_common_ptr)cinfo, JPOOL_IMAGE,
+		cinfo->output_width * (JDIMENSION)cinfo->output_components, 1U);
+	while (cinfo->output_scanline < cinfo->output_height) {
+		y = (unsigned int)cinfo->output_scanline;
+		(void)jpeg_read_scanlines(cinfo, row, 1U);
+		if (cinfo->output_components == 3) {
+			sample = luma = row[0];
+			x = cinfo->output_width;
+			do {
+				*luma++ = (JSAMPLE)((sample[0] * 77 + sample[1] * 151 +
+					sample[2] * 28 + 128) / 256);
+				sample += 3;
+			} while (--x != 0U);
+		}
+		puzzle_view_put_row(view, y, row[0]);
+	}
+}
+
+/*
+ * Decodes from fp, or from buf when fp is NULL, into either a truecolor
+ * gdimage or, when view is not NULL, straight into a luma view.
+ * Returns 0 on success, -1 on error, and 1 when the stream uses a color
+ * space that should be left to gd.
+ */
+static int puzzle_jpeg_load(PuzzleContext * const context,
+	gdImagePtr * const gdimage_,
+	PuzzleView * const view,
+	FILE * const fp,
+	const void * const buf,
+	const size_t len)
+{
+	struct jpeg_decompress_struct cinfo;
+	PuzzleJpegErrorMgr err;
+	gdImagePtr volatile gdimage = NULL;
+	int ret;
+
+	cinfo.err = jpeg_std_error(&err.pub);
+	err.pub.error_exit = puzzle_jpeg_error_exit;
+	err.pub.output_message = puzzle_jpeg_output_message;
+	jpeg_create_decompress(&cinfo);
+	if (setjmp(err.jmpbuf) != 0) {
+		if (gdimage != NULL) {
+			gdImageDestroy(gdimage);
+		}
+		jpeg_destroy_decompress(&cinfo);
+		return -1;
+	}
+	if (fp != NULL) {
+		jpeg_stdio_src(&cinfo, fp);
+	}
+	else {
+		jpeg_mem_src(&cinfo, (unsigned char *)buf, (unsigned long)len);
+	}
+	if ((ret = puzzle_jpeg_start(context, &cinfo, view != NULL)) != 0) {
+		jpeg_destroy_decompress(&cinfo);
+		return ret;
+	}
+	if (view != NULL) {
+		view->width = (unsigned int)cinfo.output_width;
+		view->height = (unsigned int)cinfo.output_height;
+		if (INT_MAX / view->width < view->height ||
+			SIZE_MAX / view->width < view->height) {
+			puzzle_err_bug(__FILE__, __LINE__);
+		}
+		view->sizeof_map = (size_t)view->width * (size_t)view->height;
+		view->origin = (size_t)0U;
+		view->stride = (size_t)view->width;
+		if ((view->map = puzzle_scratch_malloc(view->scratch,
+			view->sizeof_map)) == NULL ||
+			puzzle_view_alloc_contrasts(context, view) != 0) {
+			jpeg_destroy_decompress(&cinfo);
+			return -1;
+		}
+		puzzle_jpeg_read_view(&cinfo, view);
+	}
+	else {
+		if ((gdimage = gdImageCreateTrueColor((int)cinfo.output_width,
+			(int)cinfo.output_height)) == NULL) {
+			jpeg_destroy_decompress(&cinfo);
+			return -1;
+		}
+		puzzle_jpeg_read_gdimage(&cinfo, gdimage);
+	}
+	(void)jpeg_finish_decompress(&cinfo);
+	jpeg_destroy_decompress(&cinfo);
+	if (gdimage_ != NULL) {
+		*gdimage_ = gdimage;
+	}
+	return 0;
+}
+
+int puzzle_jpeg_create_gdimage_from_fp(PuzzleContext * const context,
+	gdImagePtr * const gdimage,
+	FILE * const fp)
+{
+	*gdimage = NULL;
+	return puzzle_jpeg_load(context, gdimage, NULL, fp, NULL, (size_t)0U);
+}
+
+int puzzle_jpeg_create_gdimage_from_memory(PuzzleContext * const context,
+	gdImagePtr * const gdimage,
+	const void * const buf,
+	const size_t len)
+{
+	*gdimage = NULL;
+	return puzzle_jpeg_load(context, gdimage, NULL, NULL, buf, len);
+}
+
+int puzzle_jpeg_getview_from_fp(PuzzleContext * const context,
+	PuzzleView * const view,
+	FILE * const fp)
+{
+	return puzzle_jpeg_load(context, NULL, view, fp, NULL, (size_t)0U);
+}
+
+int puzzle_jpeg_getview_from_memory(PuzzleContext * const context,
+	PuzzleView * const view,
+	const void * const buf,
+	const size_t len)
+{
+	return puzzle_jpeg_load(context, NULL, view, NULL, buf, len);
+}
+
+#endif
@@ -0,0 +1,180 @@
+#include "puzzle_common.h"
+#include "puzzle_p.h"
+#include "puzzle.h"
+#include "globals.h"
+
+#ifdef PUZZLE_X86
+# include <emmintrin.h>
+# include <immintrin.h>
+#endif
+
+/*
+ * Row kernels turning gd truecolor pixels (0xAARRGGBB) into 8-bit luma
+ * with the usual (77 R + 151 G + 28 B + 128) / 256 weights. All of them
+ * produce the same bytes; only the throughput differs.
+ */
+
+static void puzzle_luma_row_scalar(unsigned char * const out,
+	const int * const pixels, const size_t n)
+{
+	size_t i;
+	int pixel;
+
+	for (i = (size_t)0U; i < n; i++) {
+		pixel = pixels[i];
+		out[i] = (unsigned char)((gdTrueColorGetRed(pixel) * 77 +
+			gdTrueColorGetGreen(pixel) * 151 +
+			gdTrueColorGetBlue(pixel) * 28 + 128) / 256);
+	}
+}
+
+#ifdef PUZZLE_X86
+/*
+ * Viewed as 16-bit lanes, each pixel is [B|G] [R|A]. Masking with
+ * 0x00ff00ff leaves [B] [R] for one madd against [28] [77]; shifting by 8
+ * and masking with 0xff leaves [G] [0] for a second madd against [151] [0].
+ */
+static void puzzle_luma_row_sse2(unsigned char * const out,
+	const int * const pixels, const size_t n)
+{
+	const __m128i rb_mask = _mm_set1_epi32(0x00ff00ff);
+	const __m128i g_mask = _mm_set1_epi32(0xff);
+	const __m128i rb_weights = _mm_set1_epi32((77 << 16) | 28);
+	const __m128i g_weights = _mm_set1_epi32(151);
+	const __m128i rounding = _mm_set1_epi32(128);
+	__m128i p, l[4];
+	size_t i = (size_t)0U;
+	int k;
+
+	for (; i + 16U <= n; i += 16U) {
+		for (k = 0; k < 4; k++) {
+			p = _mm_loadu_si128((const __m128i *)(pixels + i + 4 * k));
+			l[k] = _mm_add_epi32(_mm_add_epi32(
+				_mm_madd_epi16(_mm_and_si128(p, rb_mask), rb_weights),
+				_mm_madd_epi16(_mm_and_si128(_mm_srli_epi32(p, 8), g_mask),
+				g_weights)), rounding);
+			l[k] = _mm_srli_epi32(l[k], 8);
+		}
+		_mm_storeu_si128((__m128i *)(out + i),
+			_mm_packus_epi16(_mm_packs_epi32(l[0], l[1]),
+			_mm_packs_epi32(l[2], l[3])));
+	}
+	puzzle_luma_row_scalar(out + i, pixels + i, n - i);
+}
+
+static PUZZLE_TARGET_AVX2 void puzzle_luma_row_avx2(unsigned char * const out,
+	const int * const pixels, const size_t n)
+{
+	const __m256i rb_mask = _mm256_set1_epi32(0x00ff00ff);
+	const __m256i g_mask = _mm256_set1_epi32(0xff);
+	const __m256i rb_weights = _mm256_set1_epi32((77 << 16) | 28);
+	const __m256i g_weights = _mm256_set1_epi32(151);
+	const __m256i rounding = _mm256_set1_epi32(128);
+	/* packs work within 128-bit halves; this puts the pixels back in order */
+	const __m256i order = _mm256_setr_epi32(0, 4, 1, 5, 2, 6, 3, 7);
+	__m256i p, l[4];
+	size_t i = (size_t)0U;
+	int k;
+
+	for (; i + 32U <= n; i += 32U) {
+		for (k = 0; k < 4; k++) {
+			p = _mm256_loadu_si256((const __m256i *)(pixels + i + 8 * k));
+			l[k] = _mm256_add_epi32(_mm256_add_epi32(
+				_mm256_madd_epi16(_mm256_and_si256(p, rb_mask), rb_weights),
+				_mm256_madd_epi16(_mm256_and_si256(_mm256_srli_epi32(p, 8),
+				g_mask), g_weights)), rounding);
+			l[k] = _mm256_srli_epi32(l[k], 8);
+		}
+		_mm256_storeu_si256((__m256i *)(out + i),
+			_mm256_permutevar8x32_epi32(_mm256_packus_epi16(
+			_mm256_packs_epi32(l[0], l[1]),
+			_mm256_packs_epi32(l[2], l[3])), order));
+	}
+	puzzle_luma_row_sse2(out + i, pixels + i, n - i);
+}
+#endif
+
+PuzzleLumaRowFn puzzle_luma_row_kernel(void)
+{
+#ifdef PUZZLE_X86
+	const unsigned int features = puzzle_cpu_features();
+
+	if ((features & PUZZLE_CPU_AVX2) != 0U) {
+		return puzzle_luma_row_avx2;
+	}
+	if ((features & PUZZLE_CPU_SSE2) != 0U) {
+		return puzzle_luma_row_sse2;
+	}
+#endif
+	return puzzle_luma_row_scalar;
+}
+
+/*
+ * The autocrop contrasts are plain sums of the levels along each row and
+ * each column of the map as PUZZLE_VIEW_PIXEL sees it, so they can be
+ * gathered while the map is being written. They are only worth the cost
+ * when puzzle_autocrop_view() will actually look at them.
+ */
+int puzzle_view_alloc_contrasts(PuzzleContext * const context,
+	PuzzleView * const view)
+{
+	unsigned long long *contrasts;
+
+	view->col_contrasts = view->row_contrasts = NULL;
+	if (context->puzzle_enable_autocrop == 0 ||
+		view->width < (unsigned int)PUZZLE_MIN_SIZE_FOR_CROPPING ||
+		view->height < (unsigned int)PUZZLE_MIN_SIZE_FOR_CROPPING) {
+		return 0;
+	}
+	if ((contrasts = puzzle_scratch_calloc(view->scratch,
+		(size_t)view->width + view->height, sizeof *contrasts)) == NULL) {
+		return -1;
+	}
+	view->col_contrasts = contrasts;
+	view->row_contrasts = contrasts + view->width;
+
+	return 0;
+}
+
+/*
+ * Stores one row y of the decoded image into the mirrored, column-major
+ * map, pixel x landing at (width - 1 - x) * height + (height - 1 - y),
+ * and adds each level to the contrasts of the map row and column it
+ * lands in.
+ */
+void puzzle_view_put_row(PuzzleView * const view,
+	const unsigned int y,
+	const unsigned char * const luma)
+{
+	const unsigned int width = view->width;
+	const unsigned int height = view->height;
+	const unsigned int step_x = height % width;
+	const unsigned int step_y = height / width;
+	size_t i = view->sizeof_map - 1U - y;
+	unsigned int x = 0U;
+	unsigned int mx, my;
+
+	if (view->col_contrasts == NULL) {
+		do {
+			view->map[i] = luma[x];
+			i -= height;
+		} while (++x < width);
+		return;
+	}
+	mx = (unsigned int)(i % width);
+	my = (unsigned int)(i / width);
+	do {
+		view->map[i] = luma[x];
+		view->col_contrasts[mx] += luma[x];
+		view->row_contrasts[my] += luma[x];
+		i -= height;
+		if (mx < step_x) {
+			mx += width - step_x;
+			my -= step_y + 1U;
+		}
+		else {
+			mx -= step_x;
+			my -= step_y;
+		}
+	} while (++x < width);
+}
@@ -7,11 +7,14 @@
 void puzzle_init_context(PuzzleContext * const context)
 {
     *context = puzzle_global_context;
+    /* without it, block layouts are just computed every time */
+    context->puzzle_block_cache = puzzle_new_block_cache();
 }
 
 void puzzle_free_context(PuzzleContext * const context)
 {
-    (void) context;
+    puzzle_free_block_cache(context->puzzle_block_cache);
+    context->puzzle_block_cache = NULL;
 }
 
 void puzzle_err_bug(const char * const file, const int line)
@@ -20,6 +20,27 @@ typedef struct PuzzleCompressedCvec_ {
     unsigned char *vec;
 } PuzzleCompressedCvec;
 
+typedef struct PuzzleScratch_ {
+    size_t sizeof_arena;
+    size_t used;
+    size_t spilled;
+    size_t footprint;
+    size_t peak;
+    unsigned char *arena;
+    void *spills;
+} PuzzleScratch;
+
+typedef struct PuzzleBatchInput_ {
+    const char *file;
+    const void *buf;
+    size_t len;
+} PuzzleBatchInput;
+
+typedef struct PuzzleBatchOptions_ {
+    size_t memory_budget;
+    int largest_first;
+} PuzzleBatchOptions;
+
 typedef struct PuzzleContext_ {
     unsigned int puzzle_max_width;
     unsigned int puzzle_max_height;
@@ -29,6 +50,11 @@ typedef struct PuzzleContext_ {
     double puzzle_contrast_barrier_for_cropping;
     double puzzle_max_cropping_ratio;
     int puzzle_enable_autocrop;
+    unsigned int puzzle_jpeg_scaling_min_p;
+    int puzzle_enable_jpeg_luma;
+    int puzzle_enable_avglvls_integral;
+    int puzzle_enable_avglvls_validation;
+    struct PuzzleBlockCache_ *puzzle_block_cache;
     unsigned long magic;    
 } PuzzleContext;
 
@@ -50,6 +76,17 @@ int puzzle_set_max_cropping_ratio(PuzzleContext * const context,
                                   const double ratio);
 int puzzle_set_autocrop(PuzzleContext * const context,
                         const int enable);
+int puzzle_set_jpeg_scaling_min_p(PuzzleContext * const context,
+                                  const unsigned int min_p);
+int puzzle_set_jpeg_luma(PuzzleContext * const context,
+                         const int enable);
+int puzzle_set_avglvls_integral(PuzzleContext * const context,
+                                const int enable);
+int puzzle_set_avglvls_validation(PuzzleContext * const context,
+                                  const int enable);
+void puzzle_get_block_cache_stats(PuzzleContext * const context,
+                                  unsigned long long * const hits,
+                                  unsigned long long * const misses);
 void puzzle_init_cvec(PuzzleContext * const context,
                       PuzzleCvec * const cvec);
 void puzzle_init_dvec(PuzzleContext * const context,
@@ -60,9 +97,31 @@ int puzzle_fill_dvec_from_file(PuzzleContext * const context,
 int puzzle_fill_cvec_from_file(PuzzleContext * const context,
                                PuzzleCvec * const cvec,
                                const char * const file);
+int puzzle_fill_cvec_from_file_scratch(PuzzleContext * const context,
+                                       PuzzleCvec * const cvec,
+                                       const char * const file,
+                                       PuzzleScratch * const scratch);
+int puzzle_fill_dvec_from_memory(PuzzleContext * const context,
+                                 PuzzleDvec * const dvec,
+                                 const void * const buf, const size_t len);
+int puzzle_fill_cvec_from_memory(PuzzleContext * const context,
+                                 PuzzleCvec * const cvec,
+                                 const void * const buf, const size_t len);
+int puzzle_fill_cvec_from_memory_scratch(PuzzleContext * const context,
+                                         PuzzleCvec * const cvec,
+                                         const void * const buf,
+                                         const size_t len,
+                                         PuzzleScratch * const scratch);
 int puzzle_fill_cvec_from_dvec(PuzzleContext * const context,
                                PuzzleCvec * const cvec,
                                const PuzzleDvec * const dvec);
+void puzzle_init_batch_options(PuzzleBatchOptions * const options);
+int puzzle_fill_cvecs_batch(PuzzleContext * const context,
+                            const PuzzleBatchInput * const inputs,
+                            const size_t n,
+                            PuzzleCvec * const cvecs,
+                            int * const status,
+                            const PuzzleBatchOptions * const options);
 void puzzle_free_cvec(PuzzleContext * const context,
                       PuzzleCvec * const cvec);
 void puzzle_free_dvec(PuzzleContext * const context,
@@ -73,6 +132,8 @@ int puzzle_dump_dvec(PuzzleContext * const context,
                      const PuzzleDvec * const dvec);
 int puzzle_cvec_cksum(PuzzleContext * const context,
                       const PuzzleCvec * const cvec, unsigned int * const sum);
+void puzzle_init_scratch(PuzzleScratch * const scratch);
+void puzzle_free_scratch(PuzzleScratch * const scratch);
 void puzzle_init_compressed_cvec(PuzzleContext * const context,
                                  PuzzleCompressedCvec * const compressed_cvec);
 void puzzle_free_compressed_cvec(PuzzleContext * const context,
@@ -95,6 +156,9 @@ double puzzle_vector_normalized_distance(PuzzleContext * const context,
                                          const PuzzleCvec * const cvec2,
                                          const int fix_for_texts);
 
+#define PUZZLE_ERR_IMAGE_TOO_LARGE (-2)
+#define PUZZLE_ERR_AVGLVLS_MISMATCH (-3)
+
 #define PUZZLE_CVEC_SIMILARITY_THRESHOLD 0.6
 #define PUZZLE_CVEC_SIMILARITY_HIGH_THRESHOLD 0.7
 #define PUZZLE_CVEC_SIMILARITY_LOW_THRESHOLD 0.3
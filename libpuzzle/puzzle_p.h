@@ -8,8 +8,14 @@
 typedef struct PuzzleView_ {
     unsigned int width;
     unsigned int height;
+    size_t origin;
+    size_t stride;
     size_t sizeof_map;
     unsigned char *map;
+    unsigned long long *col_contrasts;
+    unsigned long long *row_contrasts;
+    struct PuzzleBlock_ *blocks;
+    struct PuzzleScratch_ *scratch;
 } PuzzleView;
 
 typedef struct PuzzleAvgLvls_ {
@@ -18,6 +24,23 @@ typedef struct PuzzleAvgLvls_ {
     double *lvls;
 } PuzzleAvgLvls;
 
+typedef struct PuzzleBlock_ {
+    unsigned int x;
+    unsigned int y;
+    unsigned int width;
+    unsigned int height;
+} PuzzleBlock;
+
+typedef struct PuzzleIntegral_ {
+    unsigned int x0;
+    unsigned int y0;
+    unsigned int width;
+    unsigned int height;
+    unsigned int view_width;
+    unsigned int view_height;
+    unsigned int *sums;
+} PuzzleIntegral;
+
 typedef enum PuzzleImageTypeCode_ {
     PUZZLE_IMAGE_TYPE_ERROR, PUZZLE_IMAGE_TYPE_UNKNOWN, PUZZLE_IMAGE_TYPE_JPEG,
         PUZZLE_IMAGE_TYPE_GIF, PUZZLE_IMAGE_TYPE_PNG
@@ -41,6 +64,7 @@ typedef struct PuzzleImageType_ {
 #define PUZZLE_MIN_P 2
 #define PUZZLE_PIXEL_FUZZ_SIZE 1
 #define PUZZLE_NEIGHBORS 8
+#define PUZZLE_CVEC_STACK_SCRATCH 1024 /* signatures up to 12 lambdas */
 #define PUZZLE_MIN_SIZE_FOR_CROPPING 100
 #if     PUZZLE_MIN_SIZE_FOR_CROPPING < 4
 # error PUZZLE_MIN_SIZE_FOR_CROPPING
@@ -48,8 +72,14 @@ typedef struct PuzzleImageType_ {
 #define PUZZLE_DEFAULT_CONTRAST_BARRIER_FOR_CROPPING 0.05
 #define PUZZLE_DEFAULT_MAX_CROPPING_RATIO 0.25
 #define PUZZLE_DEFAULT_ENABLE_AUTOCROP 1
+#define PUZZLE_DEFAULT_JPEG_SCALING_MIN_P 0U
+#define PUZZLE_DEFAULT_ENABLE_JPEG_LUMA 0
+#define PUZZLE_DEFAULT_ENABLE_AVGLVLS_INTEGRAL 0
+#define PUZZLE_DEFAULT_ENABLE_AVGLVLS_VALIDATION 0
+#define PUZZLE_LUMA_TILE 64
 
-#define PUZZLE_VIEW_PIXEL(V, X, Y) (*((V)->map + (V)->width * (Y) + (X)))
+#define PUZZLE_VIEW_PIXEL(V, X, Y) \
+    (*((V)->map + (V)->origin + (V)->stride * (Y) + (X)))
 #define PUZZLE_AVGLVL(A, X, Y) (*((A)->lvls + (A)->lambdas * (Y) + (X)))
 
 #define PUZZLE_CONTEXT_MAGIC 0xdeadbeef
@@ -65,4 +95,118 @@ typedef struct PuzzleImageType_ {
 
 void puzzle_err_bug(const char * const file, const int line);
 
+struct PuzzleContext_;
+struct PuzzleDvec_;
+struct PuzzleCvec_;
+struct PuzzleScratch_;
+
+#if defined(__x86_64__) || defined(__i386__) || \
+    defined(_M_X64) || defined(_M_IX86)
+# define PUZZLE_X86 1
+#endif
+#if defined(__GNUC__) || defined(__clang__)
+# define PUZZLE_TARGET_SSE41 __attribute__((target("sse4.1")))
+# define PUZZLE_TARGET_AVX2 __attribute__((target("avx2")))
+# define PUZZLE_TARGET_AVX512BW __attribute__((target("avx512f,avx512bw")))
+#else
+# define PUZZLE_TARGET_SSE41
+# define PUZZLE_TARGET_AVX2
+# define PUZZLE_TARGET_AVX512BW
+#endif
+
+/* Interlocked primitives shared by the block cache and the batch slots */
+#ifdef _MSC_VER
+# include <intrin.h>
+# define PUZZLE_CAS_LONG(P, O, N) \
+    (_InterlockedCompareExchange((P), (N), (O)) == (O))
+# define PUZZLE_RELEASE_LONG(P) ((void)_InterlockedExchange((P), 0L))
+# define PUZZLE_BARRIER() _ReadWriteBarrier()
+#else
+# define PUZZLE_CAS_LONG(P, O, N) __sync_bool_compare_and_swap((P), (O), (N))
+# define PUZZLE_RELEASE_LONG(P) __sync_lock_release(P)
+# define PUZZLE_BARRIER() __sync_synchronize()
+#endif
+
+#define PUZZLE_CPU_SSE2     0x1U
+#define PUZZLE_CPU_SSE41    0x2U
+#define PUZZLE_CPU_AVX2     0x4U
+#define PUZZLE_CPU_AVX512BW 0x8U
+
+unsigned int puzzle_cpu_features(void);
+
+typedef void (*PuzzleDistanceFn)(const signed char * const vec1,
+                                 const signed char * const vec2,
+                                 const size_t size,
+                                 const int fix_for_texts,
+                                 unsigned long sums[3]);
+PuzzleDistanceFn puzzle_vector_distance_kernel_for(const unsigned int features);
+
+typedef void (*PuzzleLumaRowFn)(unsigned char * const out,
+                                const int * const pixels, const size_t n);
+
+PuzzleLumaRowFn puzzle_luma_row_kernel(void);
+int puzzle_view_alloc_contrasts(struct PuzzleContext_ * const context,
+                                PuzzleView * const view);
+void puzzle_view_put_row(PuzzleView * const view,
+                         const unsigned int y,
+                         const unsigned char * const luma);
+
+int puzzle_scratch_begin(struct PuzzleScratch_ * const scratch);
+void *puzzle_scratch_malloc(struct PuzzleScratch_ * const scratch,
+                            const size_t size);
+void *puzzle_scratch_calloc(struct PuzzleScratch_ * const scratch,
+                            const size_t nmemb, const size_t size);
+void puzzle_scratch_free(struct PuzzleScratch_ * const scratch,
+                         void * const ptr);
+int puzzle_fill_vec_from_file(struct PuzzleContext_ * const context,
+                              struct PuzzleDvec_ * const dvec,
+                              struct PuzzleCvec_ * const cvec,
+                              const char * const file,
+                              struct PuzzleScratch_ * const scratch);
+int puzzle_fill_vec_from_memory(struct PuzzleContext_ * const context,
+                                struct PuzzleDvec_ * const dvec,
+                                struct PuzzleCvec_ * const cvec,
+                                const void * const buf,
+                                const size_t len,
+                                struct PuzzleScratch_ * const scratch);
+unsigned int puzzle_get_column_neighbors(const PuzzleAvgLvls * const avglvls,
+                                         const unsigned int lx,
+                                         double * const diffs);
+int puzzle_fill_cvec_from_avglvls(struct PuzzleContext_ * const context,
+                                  struct PuzzleCvec_ * const cvec,
+                                  const PuzzleAvgLvls * const avglvls,
+                                  struct PuzzleScratch_ * const scratch);
+
+typedef struct PuzzleBlockCache_ PuzzleBlockCache;
+
+PuzzleBlockCache *puzzle_new_block_cache(void);
+void puzzle_free_block_cache(PuzzleBlockCache * const cache);
+void puzzle_compute_blocks(struct PuzzleContext_ * const context,
+                           PuzzleBlock * const blocks,
+                           const unsigned int view_width,
+                           const unsigned int view_height,
+                           const unsigned int lambdas);
+void puzzle_get_blocks(struct PuzzleContext_ * const context,
+                       PuzzleBlock * const blocks,
+                       const unsigned int view_width,
+                       const unsigned int view_height,
+                       const unsigned int lambdas);
+
+#ifdef HAVE_JPEGLIB_H
+int puzzle_jpeg_create_gdimage_from_fp(struct PuzzleContext_ * const context,
+                                       gdImagePtr * const gdimage,
+                                       FILE * const fp);
+int puzzle_jpeg_create_gdimage_from_memory(struct PuzzleContext_ * const context,
+                                           gdImagePtr * const gdimage,
+                                           const void * const buf,
+                                           const size_t len);
+int puzzle_jpeg_getview_from_fp(struct PuzzleContext_ * const context,
+                                PuzzleView * const view,
+                                FILE * const fp);
+int puzzle_jpeg_getview_from_memory(struct PuzzleContext_ * const context,
+                                    PuzzleView * const view,
+                                    const void * const buf,
+                                    const size_t len);
+#endif
+
 #endif
@@ -0,0 +1,164 @@
+#include "puzzle_common.h"
+#include "puzzle_p.h"
+#include "puzzle.h"
+#include "globals.h"
+
+/*
+ * Every block starts with a header, so it can be freed without knowing
+ * where it came from. Blocks are carved from the arena stack-wise; those
+ * that do not fit come from malloc, are chained so that they can be
+ * reclaimed with the rest, and make the next puzzle_scratch_begin() grow
+ * the arena, so a scratch reused on images of similar size settles
+ * into making no allocation at all.
+ */
+typedef struct PuzzleScratchHeader_ {
+	size_t size;
+	int spilled;
+	struct PuzzleScratchHeader_ *prev;
+	struct PuzzleScratchHeader_ *next;
+} PuzzleScratchHeader;
+
+#define PUZZLE_SCRATCH_ALIGN 32U
+#define PUZZLE_SCRATCH_HEADER \
+	((sizeof(PuzzleScratchHeader) + PUZZLE_SCRATCH_ALIGN - 1U) & \
+	~(size_t)(PUZZLE_SCRATCH_ALIGN - 1U))
+
+void puzzle_init_scratch(PuzzleScratch * const scratch)
+{
+	scratch->sizeof_arena = (size_t)0U;
+	scratch->used = (size_t)0U;
+	scratch->spilled = (size_t)0U;
+	scratch->footprint = scratch->peak = (size_t)0U;
+	scratch->arena = NULL;
+	scratch->spills = NULL;
+}
+
+static void puzzle_scratch_free_spills(PuzzleScratch * const scratch)
+{
+	PuzzleScratchHeader *header = scratch->spills;
+	PuzzleScratchHeader *next;
+
+	while (header != NULL) {
+		next = header->next;
+		free(header);
+		header = next;
+	}
+	scratch->spills = NULL;
+	scratch->spilled = (size_t)0U;
+}
+
+void puzzle_free_scratch(PuzzleScratch * const scratch)
+{
+	puzzle_scratch_free_spills(scratch);
+	free(scratch->arena);
+	puzzle_init_scratch(scratch);
+}
+
+/*
+ * Starts a new image: everything handed out since the previous call is
+ * released at once, and the arena grows to the largest footprint seen.
+ */
+int puzzle_scratch_begin(PuzzleScratch * const scratch)
+{
+	unsigned char *arena;
+
+	puzzle_scratch_free_spills(scratch);
+	scratch->used = scratch->footprint = (size_t)0U;
+	if (scratch->peak <= scratch->sizeof_arena) {
+		return 0;
+	}
+	if ((arena = malloc(scratch->peak)) == NULL) {
+		return -1;
+	}
+	free(scratch->arena);
+	scratch->arena = arena;
+	scratch->sizeof_arena = scratch->peak;
+
+	return 0;
+}
+
+void *puzzle_scratch_malloc(PuzzleScratch * const scratch, const size_t size)
+{
+	PuzzleScratchHeader *header;
+	size_t total;
+
+	if (scratch == NULL) {
+		return malloc(size);
+	}
+	if (size > SIZE_MAX - PUZZLE_SCRATCH_HEADER - PUZZLE_SCRATCH_ALIGN) {
+		return NULL;
+	}
+	total = (PUZZLE_SCRATCH_HEADER + size + PUZZLE_SCRATCH_ALIGN - 1U) &
+		~(size_t)(PUZZLE_SCRATCH_ALIGN - 1U);
+	if (scratch->sizeof_arena - scratch->used >= total) {
+		header = (PuzzleScratchHeader *)(scratch->arena + scratch->used);
+		header->spilled = 0;
+		scratch->used += total;
+	}
+	else {
+		if ((header = malloc(total)) == NULL) {
+			return NULL;
+		}
+		header->spilled = 1;
+		header->prev = NULL;
+		if ((header->next = scratch->spills) != NULL) {
+			header->next->prev = header;
+		}
+		scratch->spills = header;
+		scratch->spilled += total;
+	}
+	header->size = total;
+	scratch->footprint =
+		MAX(scratch->footprint, scratch->used + scratch->spilled);
+	scratch->peak = MAX(scratch->peak, scratch->footprint);
+
+	return (unsigned char *)header + PUZZLE_SCRATCH_HEADER;
+}
+
+void *puzzle_scratch_calloc(PuzzleScratch * const scratch,
+	const size_t nmemb, const size_t size)
+{
+	void *ptr;
+
+	if (scratch == NULL) {
+		return calloc(nmemb, size);
+	}
+	if (size != (size_t)0U && nmemb > SIZE_MAX / size) {
+		return NULL;
+	}
+	if ((ptr = puzzle_scratch_malloc(scratch, nmemb * size)) != NULL) {
+		memset(ptr, 0, nmemb * size);
+	}
+	return ptr;
+}
+
+/* Arena blocks are only reclaimed when they are the last one handed out */
+void puzzle_scratch_free(PuzzleScratch * const scratch, void * const ptr)
+{
+	PuzzleScratchHeader *header;
+
+	if (scratch == NULL || ptr == NULL) {
+		free(ptr);
+		return;
+	}
+	header = (PuzzleScratchHeader *)
+		((unsigned char *)ptr - PUZZLE_SCRATCH_HEADER);
+	if (header->spilled != 0) {
+		if (header->prev != NULL) {
+			header->prev->next = header->next;
+		}
+		else {
+			scratch->spills = header->next;
+		}
+		if (header->next != NULL) {
+			header->next->prev = header->prev;
+		}
+		scratch->spilled -= header->size;
+		free(header);
+		return;
+	}
+	if ((unsigned char *)header + header->size ==
+		scratch->arena + scratch->used) {
+		scratch->used -= header->size;
+	}
+}
@@ -82,3 +82,45 @@ int puzzle_set_autocrop(PuzzleContext * const context, const int enable)
     
     return 0;
 }
+
+int puzzle_set_jpeg_scaling_min_p(PuzzleContext * const context,
+                                  const unsigned int min_p)
+{
+#ifndef HAVE_JPEGLIB_H
+    /* scaled decoding needs libpuzzle to be built with the libjpeg headers */
+    if (min_p > 0U) {
+        return -1;
+    }
+#endif
+    context->puzzle_jpeg_scaling_min_p = min_p;
+
+    return 0;
+}
+
+int puzzle_set_jpeg_luma(PuzzleContext * const context, const int enable)
+{
+#ifndef HAVE_JPEGLIB_H
+    if (enable != 0) {
+        return -1;
+    }
+#endif
+    context->puzzle_enable_jpeg_luma = (enable != 0);
+
+    return 0;
+}
+
+int puzzle_set_avglvls_integral(PuzzleContext * const context,
+                                const int enable)
+{
+    context->puzzle_enable_avglvls_integral = (enable != 0);
+
+    return 0;
+}
+
+int puzzle_set_avglvls_validation(PuzzleContext * const context,
+                                  const int enable)
+{
+    context->puzzle_enable_avglvls_validation = (enable != 0);
+
+    return 0;
+}
@@ -0,0 +1,86 @@
+#include "filehash.h"
+#include <cstdio>
+#include <cstring>
+#include <vector>
+
+using namespace std;
+
+static const unsigned long long PRIME1 = 0x9E3779B185EBCA87ULL;
+static const unsigned long long PRIME2 = 0xC2B2AE3D27D4EB4FULL;
+static const size_t CHUNK_SIZE = 1 << 16; // multiple of 8, so only the last chunk has a tail
+
+static inline unsigned long long rotl64(unsigned long long x, int r)
+{
+	return (x << r) | (x >> (64 - r));
+}
+
+// mixes 8 bytes at a time, in the spirit of xxHash64 with a single lane
+static unsigned long long hashChunk(unsigned long long h, const unsigned char* data, size_t length)
+{
+	size_t i = 0;
+
+	for (; i + 8 <= length; i += 8){
+		unsigned long long word;
+		memcpy(&word, data + i, 8);
+		h ^= rotl64(word * PRIME2, 31) * PRIME1;
+		h = rotl64(h, 27) * PRIME1 + PRIME2;
+	}
+	for (; i < length; i++){
+		h ^= data[i] * PRIME1;
+		h = rotl64(h, 11) * PRIME2;
+	}
+	return h;
+}
+
+void hashFile(const char* fileName, FileDigest& digest)
+{
+	FILE *fp = fopen(fileName, "rb");
+	unsigned long long h = PRIME1;
+	vector<unsigned char> buffer(CHUNK_SIZE);
+	size_t got;
+
+	digest.ok = false;
+	digest.size = 0;
+	digest.hash = 0;
+	if (fp == NULL)
+		return;
+	while ((got = fread(&buffer[0], 1, CHUNK_SIZE, fp)) > 0){
+		h = hashChunk(h, &buffer[0], got);
+		digest.size += got;
+	}
+	digest.ok = ferror(fp) == 0;
+	fclose(fp);
+
+	h ^= digest.size;
+	h ^= h >> 33;
+	h *= PRIME2;
+	h ^= h >> 29;
+	h *= PRIME1;
+	h ^= h >> 32;
+	digest.hash = h;
+}
+
+bool sameContents(const char* fileName1, const char* fileName2)
+{
+	FILE *fp1 = fopen(fileName1, "rb");
+	FILE *fp2 = fopen(fileName2, "rb");
+	vector<unsigned char> buffer1(CHUNK_SIZE), buffer2(CHUNK_SIZE);
+	size_t got1, got2;
+	bool same = fp1 != NULL && fp2 != NULL;
+
+	while (same){
+		got1 = fread(&buffer1[0], 1, CHUNK_SIZE, fp1);
+		got2 = fread(&buffer2[0], 1, CHUNK_SIZE, fp2);
+		if (got1 != got2 || memcmp(&buffer1[0], &buffer2[0], got1) != 0){
+			same = false;
+		} else if (got1 < CHUNK_SIZE){
+			same = ferror(fp1) == 0 && ferror(fp2) == 0;
+			break;
+		}
+	}
+	if (fp1 != NULL)
+		fclose(fp1);
+	if (fp2 != NULL)
+		fclose(fp2);
+	return same;
+}
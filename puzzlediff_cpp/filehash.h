@@ -0,0 +1,24 @@
+#ifndef H_FILEHASH
+#define H_FILEHASH 1
+
+/* Size and 64 bit content hash of a file, used to spot byte-identical copies */
+struct FileDigest {
+	bool ok;
+	unsigned long long size;
+	unsigned long long hash;
+
+	bool operator<(const FileDigest& other) const {
+		return size < other.size || (size == other.size && hash < other.hash);
+	}
+	bool operator==(const FileDigest& other) const {
+		return size == other.size && hash == other.hash;
+	}
+};
+
+// streams the file through a fast non-cryptographic hash, ok is false if it can't be read
+void hashFile(const char* fileName, FileDigest& digest);
+
+// true only if both files can be read and hold the same bytes, used to confirm digest matches
+bool sameContents(const char* fileName1, const char* fileName2);
+
+#endif /* ! H_FILEHASH */
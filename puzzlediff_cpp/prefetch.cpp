@@ -0,0 +1,113 @@
+#include "prefetch.h"
+#include <cstdio>
+
+using namespace std;
+
+Prefetcher::Prefetcher(const vector<string>& fileNames, size_t maxFiles, size_t maxBytes,
+                       unsigned int readerCount)
+	: fileNames(fileNames), maxFiles(maxFiles > 0 ? maxFiles : 1), maxBytes(maxBytes),
+	  readerCount(readerCount > 0 ? readerCount : 1), nextIndex(0), inFlight(0),
+	  activeReaders(0), queuedBytes(0), done(false), stopping(false)
+{
+}
+
+Prefetcher::~Prefetcher()
+{
+	{
+		// unblock the readers if the consumers stopped early
+		lock_guard<mutex> lock(queueMutex);
+		stopping = true;
+	}
+	notFull.notify_all();
+	for (size_t i = 0; i < readers.size(); i++){
+		if (readers[i].joinable())
+			readers[i].join();
+	}
+}
+
+void Prefetcher::start()
+{
+	activeReaders = readerCount;
+	for (unsigned int i = 0; i < readerCount; i++)
+		readers.push_back(thread(&Prefetcher::run, this));
+}
+
+void Prefetcher::run()
+{
+	unsigned int files = fileNames.size();
+
+	for (;;){
+		PrefetchedFile file;
+		size_t size = 0;
+		FILE *fp;
+
+		// claim the next file
+		{
+			lock_guard<mutex> lock(queueMutex);
+			if (stopping || nextIndex >= files)
+				break;
+			file.index = nextIndex++;
+		}
+		file.ok = false;
+		fp = fopen(fileNames[file.index].c_str(), "rb");
+		if (fp != NULL && fseek(fp, 0L, SEEK_END) == 0){
+			long end = ftell(fp);
+			if (end > 0 && fseek(fp, 0L, SEEK_SET) == 0){
+				size = (size_t)end;
+			}
+		}
+
+		// reserve room in the read-ahead window before reading
+		{
+			unique_lock<mutex> lock(queueMutex);
+			while (!stopping && (queue.size() + inFlight >= maxFiles ||
+				(queue.size() + inFlight > 0 && queuedBytes + size > maxBytes)))
+				notFull.wait(lock);
+			if (stopping){
+				if (fp != NULL)
+					fclose(fp);
+				break;
+			}
+			queuedBytes += size;
+			inFlight++;
+		}
+
+		if (size > 0){
+			file.data.resize(size);
+			file.ok = fread(&file.data[0], 1, size, fp) == size;
+		}
+		if (fp != NULL)
+			fclose(fp);
+
+		{
+			lock_guard<mutex> lock(queueMutex);
+			inFlight--;
+			queue.push_back(move(file));
+		}
+		notEmpty.notify_one();
+	}
+
+	// the last reader to finish wakes up the consumers waiting for more input
+	{
+		lock_guard<mutex> lock(queueMutex);
+		if (--activeReaders == 0)
+			done = true;
+	}
+	notEmpty.notify_all();
+}
+
+bool Prefetcher::pop(PrefetchedFile& file)
+{
+	{
+		unique_lock<mutex> lock(queueMutex);
+		while (queue.empty() && !done)
+			notEmpty.wait(lock);
+		if (queue.empty())
+			return false;
+		file = move(queue.front());
+		queue.pop_front();
+		queuedBytes -= file.data.size();
+	}
+	notFull.notify_all();
+	return true;
+}
@@ -0,0 +1,57 @@
+#ifndef H_PREFETCH
+#define H_PREFETCH 1
+
+#include <vector>
+#include <string>
+#include <deque>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+
+/* A file whose contents were read ahead of the signature stage */
+struct PrefetchedFile {
+	unsigned int index;
+	bool ok;
+	std::vector<unsigned char> data;
+};
+
+/*
+ * Reads files on a pool of background threads into a bounded queue, so the
+ * compute workers turning buffers into cvecs do not block on fopen/fread.
+ * Several readers keep more requests outstanding on fast storage without
+ * adding compute threads; files may therefore arrive out of order.
+ * At most maxFiles files and maxBytes bytes are held or being read at once
+ * (a single file larger than maxBytes is still let through when nothing
+ * else is queued).
+ */
+class Prefetcher {
+public:
+	Prefetcher(const std::vector<std::string>& fileNames, size_t maxFiles, size_t maxBytes,
+	           unsigned int readerCount = 1);
+	~Prefetcher();
+
+	void start();
+	// blocks until a file is available; returns false once all files were handed out
+	bool pop(PrefetchedFile& file);
+
+private:
+	void run();
+
+	const std::vector<std::string>& fileNames;
+	const size_t maxFiles;
+	const size_t maxBytes;
+	const unsigned int readerCount;
+	unsigned int nextIndex;
+	size_t inFlight;
+	unsigned int activeReaders;
+	size_t queuedBytes;
+	bool done;
+	bool stopping;
+	std::deque<PrefetchedFile> queue;
+	std::mutex queueMutex;
+	std::condition_variable notEmpty;
+	std::condition_variable notFull;
+	std::vector<std::thread> readers;
+};
+
+#endif /* ! H_PREFETCH */
@@ -7,10 +7,16 @@ extern "C" {
 #include <vector>
 #include <iostream>
 #include "listdir.h"
+#include "prefetch.h"
+#include "filehash.h"
+#include "scratchpool.h"
 #include <fstream>
 #include <cilk/cilk.h>
+#include <cilk/cilk_api.h>
+#include <cilk/reducer_opadd.h>
 #include "cilktime.h"
 #include <algorithm>
+#include <map>
 
 
 /*******************************************************
@@ -24,11 +30,19 @@ extern "C" {
 using namespace std;
 
 const double IDENTITY_THRESHOLD = 0.12;
+const size_t DEFAULT_PREFETCH_MEGABYTES = 64;
+const unsigned int DEFAULT_SCRATCH_IDLE_RELEASE = 32;
+const unsigned int SAME_AS_REFERENCE = (unsigned int)-1;
 
 typedef struct Opts_ {
 	const char *refImage;
     const char *dir;
     int fix_for_texts;
+    size_t prefetchFiles; // 0 = no pipelining
+    size_t prefetchBytes;
+    unsigned int prefetchReaders;
+    bool dedupe;
+    unsigned int scratchIdleRelease; // 0 = never release
 } Opts;
 
 typedef struct ImageDistancePair_ {
@@ -41,7 +55,7 @@ ofstream outputStream;
 
 void usage(void)
 {
-    puts("\nUsage: puzzle-diff [-o <outputFile>] referenceImage directory\n");
+    puts("\nUsage: puzzle-diff [-o <outputFile>] [-d] [-i <images>] [-p <files> [-m <megabytes>] [-r <readers>]] referenceImage directory\n");
     exit(EXIT_SUCCESS);
 }
 
@@ -61,7 +75,12 @@ int parse_opts(Opts * const opts, PuzzleContext * context,
     extern int poptind;
 
     opts->fix_for_texts = 1;
-    while ((opt = pgetopt(argc, argv, "o:")) != -1) {
+    opts->prefetchFiles = 0;
+    opts->prefetchBytes = DEFAULT_PREFETCH_MEGABYTES << 20;
+    opts->prefetchReaders = 1;
+    opts->dedupe = false;
+    opts->scratchIdleRelease = DEFAULT_SCRATCH_IDLE_RELEASE;
+    while ((opt = pgetopt(argc, argv, "o:p:m:r:di:")) != -1) {
         switch (opt) {
         case 'o':
             // set output text atof(poptarg);
@@ -74,6 +93,26 @@ int parse_opts(Opts * const opts, PuzzleContext * context,
 				outputFile = "";
 			}
 			break;
+        case 'p':
+            // read-ahead depth in files, enables the pipelined mode
+            opts->prefetchFiles = (size_t)atoi(poptarg);
+            break;
+        case 'm':
+            // read-ahead budget in megabytes
+            opts->prefetchBytes = (size_t)atoi(poptarg) << 20;
+            break;
+        case 'r':
+            // number of reader threads keeping I/O requests outstanding
+            opts->prefetchReaders = (unsigned int)atoi(poptarg);
+            break;
+        case 'd':
+            // decode only one of several byte-identical files
+            opts->dedupe = true;
+            break;
+        case 'i':
+            // release a worker's buffers after this many images used less than half of them
+            opts->scratchIdleRelease = (unsigned int)atoi(poptarg);
+            break;
         default:
             usage();      
         }
@@ -90,6 +129,139 @@ int parse_opts(Opts * const opts, PuzzleContext * context,
 }
 
 
+/**********************************************
+* Turn the result of filling cvec into a distance entry
+***********************************************/
+void storeDistance(PuzzleContext * context, const PuzzleCvec * cvec1, const Opts& opts,
+                   const char* fileName, int ret, const PuzzleCvec * cvec, ImageDistancePair& pair){
+	if (ret == 0){
+		pair.distance = puzzle_vector_normalized_distance(context, cvec1, cvec, opts.fix_for_texts);
+		pair.fileName = fileName;
+	}
+	else {
+		pair.distance = 100.0; // will be filtered out
+		pair.fileName = ""; // invalid
+		fprintf(stderr, "Unable to read image [%s]\n", fileName); // skip this iteration
+	}
+}
+
+
+/**********************************************
+* Pipelined mode: reader threads load files ahead while
+* the cilk workers turn loaded buffers into cvecs
+***********************************************/
+void computeDistancesPipelined(PuzzleContext * context, const PuzzleCvec * cvec1, const Opts& opts, ScratchPool& scratchPool,
+                               const vector<string>& fileNamesVector, vector<ImageDistancePair>& distances){
+	Prefetcher prefetcher(fileNamesVector, opts.prefetchFiles, opts.prefetchBytes, opts.prefetchReaders);
+	cilk::reducer_opadd<unsigned long long> stallTicks(0);
+	int workers = __cilkrts_get_nworkers();
+
+	prefetcher.start();
+
+	// one consumer loop per worker, each takes whatever file has been loaded next
+	#pragma cilk grainsize = 1
+	cilk_for(int w = 0; w < workers; w++){
+		PrefetchedFile file;
+
+		for (;;){
+			unsigned long long waitStart = cilk_getticks();
+			if (!prefetcher.pop(file))
+				break;
+			stallTicks += cilk_getticks() - waitStart;
+
+			PuzzleCvec puzzleCvec;
+			const char* fileName = fileNamesVector[file.index].c_str();
+			int ret = -1;
+			ScratchLease scratch(scratchPool);
+
+			// the cvec lives in the borrowed scratch, not on the heap
+			puzzle_init_cvec(context, &puzzleCvec);
+			if (file.ok)
+				ret = puzzle_fill_cvec_from_memory_scratch(context, &puzzleCvec, &file.data[0], file.data.size(), scratch.get());
+			storeDistance(context, cvec1, opts, fileName, ret, &puzzleCvec, distances[file.index]);
+		}
+	}
+	std::cout << "compute workers stalled waiting for input for " << cilk_ticks_to_seconds(stallTicks.get_value())
+		<< " seconds in total." << std::endl;
+}
+
+
+/**********************************************
+* Load each file in one thread, stores the results in an array and sort later to avoid data races
+***********************************************/
+void computeDistances(PuzzleContext * context, const PuzzleCvec * cvec1, const Opts& opts, ScratchPool& scratchPool,
+                      const vector<string>& fileNamesVector, vector<ImageDistancePair>& distances){
+	unsigned int files = fileNamesVector.size();
+
+	cilk_for(unsigned int i = 0; i < files; i++){
+		PuzzleCvec puzzleCvec;
+		const char* fileName = fileNamesVector[i].c_str();
+		ImageDistancePair pair;
+		int ret;
+		ScratchLease scratch(scratchPool);
+		
+		// calculate puzzle vector and distance, the cvec lives in the borrowed scratch
+		ret = puzzle_fill_cvec_from_file_scratch(context, &puzzleCvec, fileName, scratch.get());
+		storeDistance(context, cvec1, opts, fileName, ret, &puzzleCvec, pair);
+		distances[i] = pair;
+	}
+}
+
+
+/**********************************************
+* Hash all files in parallel and keep one representative per content.
+* representative[i] is the index in uniqueNames whose result file i shares,
+* or SAME_AS_REFERENCE for byte copies of the reference image.
+* A digest match is only trusted after a byte comparison, so a hash
+* collision costs a file read instead of a wrong result.
+* Returns the number of files that don't need to be decoded.
+***********************************************/
+unsigned int findDuplicates(const char* refImage, const vector<string>& fileNamesVector,
+                            vector<string>& uniqueNames, vector<unsigned int>& representative){
+	unsigned int files = fileNamesVector.size();
+	vector<FileDigest> digests(files);
+	FileDigest refDigest;
+	multimap<FileDigest, unsigned int> seen;
+
+	cilk_spawn hashFile(refImage, refDigest);
+	cilk_for(unsigned int i = 0; i < files; i++){
+		hashFile(fileNamesVector[i].c_str(), digests[i]);
+	}
+	cilk_sync;
+
+	uniqueNames.clear();
+	representative.resize(files);
+	for (unsigned int i = 0; i < files; i++){
+		if (!digests[i].ok){ // let the decoder report it
+			representative[i] = uniqueNames.size();
+			uniqueNames.push_back(fileNamesVector[i]);
+			continue;
+		}
+		if (refDigest.ok && digests[i] == refDigest &&
+			sameContents(refImage, fileNamesVector[i].c_str())){
+			representative[i] = SAME_AS_REFERENCE;
+			continue;
+		}
+		// colliding contents keep their own representatives under the same digest
+		pair<multimap<FileDigest, unsigned int>::iterator,
+			multimap<FileDigest, unsigned int>::iterator> range = seen.equal_range(digests[i]);
+		multimap<FileDigest, unsigned int>::iterator it = range.first;
+		while (it != range.second &&
+			!sameContents(uniqueNames[it->second].c_str(), fileNamesVector[i].c_str())){
+			++it;
+		}
+		if (it != range.second){
+			representative[i] = it->second;
+			continue;
+		}
+		seen.insert(make_pair(digests[i], (unsigned int)uniqueNames.size()));
+		representative[i] = uniqueNames.size();
+		uniqueNames.push_back(fileNamesVector[i]);
+	}
+	return files - uniqueNames.size();
+}
+
+
 /**********************************************
 * Sort images from imagelist into toplist
 ***********************************************/
@@ -154,26 +326,40 @@ int main(int argc, char *argv[])
 	vector<ImageDistancePair> distances(files);
 	start_ticks = cilk_getticks();
 
-	// load each file in one thread, stores the results in an array and sort later to avoid data races 
-	cilk_for(unsigned int i = 0; i < files; i++){
-		PuzzleCvec puzzleCvec;
-		double d;
-		const char* fileName = fileNamesVector[i].c_str();
-		ImageDistancePair pair;
-		
-		// calculate puzzle vector and distance
-		puzzle_init_cvec(&context, &puzzleCvec);
-		if (puzzle_fill_cvec_from_file(&context, &puzzleCvec, fileName) == 0){
-			pair.distance = puzzle_vector_normalized_distance(&context, &cvec1, &puzzleCvec, opts.fix_for_texts);
-			pair.fileName = fileName;
-		}
-		else {
-			pair.distance = 100.0; // will be filtered out
-			pair.fileName = ""; // invalid
-			fprintf(stderr, "Unable to read image [%s]\n", fileName); // skip this iteration
+	// with -d only one file per distinct content is decoded
+	vector<string> uniqueNames;
+	vector<unsigned int> representative;
+	const vector<string>* workNames = &fileNamesVector;
+	if (opts.dedupe){
+		unsigned int duplicates = findDuplicates(opts.refImage, fileNamesVector, uniqueNames, representative);
+		workNames = &uniqueNames;
+		std::cout << duplicates << " byte-identical files skipped, hashed in " << (cilk_getticks() - start_ticks) << " milliseconds." << std::endl;
+	}
+	vector<ImageDistancePair> workDistances(workNames->size());
+	ScratchPool scratchPool(opts.scratchIdleRelease);
+
+	if (opts.prefetchFiles > 0){
+		computeDistancesPipelined(&context, &cvec1, opts, scratchPool, *workNames, workDistances);
+	}
+	else {
+		computeDistances(&context, &cvec1, opts, scratchPool, *workNames, workDistances);
+	}
+
+	if (opts.dedupe){
+		// fan the results out to the duplicates
+		for (unsigned int i = 0; i < files; i++){
+			if (representative[i] == SAME_AS_REFERENCE){
+				distances[i].distance = 0.0;
+				distances[i].fileName = fileNamesVector[i];
+				continue;
+			}
+			distances[i] = workDistances[representative[i]];
+			if (distances[i].fileName != "")
+				distances[i].fileName = fileNamesVector[i];
 		}
-		distances[i] = pair;
-		puzzle_free_cvec(&context, &puzzleCvec);
+	}
+	else {
+		distances.swap(workDistances);
 	}
 	std::cout << "all images loaded in " << (cilk_getticks() - start_ticks) << " milliseconds." << std::endl;
 
@@ -0,0 +1,55 @@
+#include "scratchpool.h"
+
+using namespace std;
+
+ScratchPool::ScratchPool(unsigned int idleRelease)
+	: idleRelease(idleRelease)
+{
+}
+
+ScratchPool::~ScratchPool()
+{
+	for (size_t i = 0; i < slots.size(); i++){
+		puzzle_free_scratch(&slots[i]->scratch);
+		delete slots[i];
+	}
+}
+
+PuzzleScratch *ScratchPool::borrow()
+{
+	Slot *slot;
+
+	{
+		lock_guard<mutex> lock(poolMutex);
+		if (!freeSlots.empty()){
+			slot = freeSlots.back();
+			freeSlots.pop_back();
+			return &slot->scratch;
+		}
+	}
+	// the first images on a new strand pay for the arena, later ones reuse it
+	slot = new Slot;
+	puzzle_init_scratch(&slot->scratch);
+	slot->idle = 0;
+	lock_guard<mutex> lock(poolMutex);
+	slots.push_back(slot);
+	return &slot->scratch;
+}
+
+void ScratchPool::giveBack(PuzzleScratch *scratch)
+{
+	// scratch is the first member, so this is the slot it was borrowed from
+	Slot *slot = reinterpret_cast<Slot*>(scratch);
+
+	if (idleRelease > 0){
+		if (scratch->footprint > scratch->sizeof_arena / 2){
+			slot->idle = 0;
+		}
+		else if (++slot->idle >= idleRelease){
+			puzzle_free_scratch(scratch);
+			slot->idle = 0;
+		}
+	}
+	lock_guard<mutex> lock(poolMutex);
+	freeSlots.push_back(slot);
+}
@@ -0,0 +1,61 @@
+#ifndef H_SCRATCHPOOL
+#define H_SCRATCHPOOL 1
+
+extern "C" {
+  #include "puzzle_common.h"
+  #include "puzzle.h"
+}
+
+#include <vector>
+#include <mutex>
+
+/*
+ * Reusable libpuzzle scratch arenas for the cilk workers. A strand borrows
+ * one for the whole computation of a cvec and gives it back afterwards, so
+ * arenas are never shared even when libpuzzle's own cilk_for lets the
+ * strand resume on another worker. The pool grows to the number of strands
+ * that were ever busy at once, which is about the number of workers.
+ * An arena that has not needed half of its size for idleRelease images in
+ * a row is released and regrows to what the next images need (0 = keep
+ * every arena at its high-water mark).
+ */
+class ScratchPool {
+public:
+	explicit ScratchPool(unsigned int idleRelease);
+	~ScratchPool();
+
+	PuzzleScratch *borrow();
+	void giveBack(PuzzleScratch *scratch);
+
+private:
+	struct Slot {
+		PuzzleScratch scratch;
+		unsigned int idle;
+	};
+
+	ScratchPool(const ScratchPool&);
+	ScratchPool& operator=(const ScratchPool&);
+
+	const unsigned int idleRelease;
+	std::vector<Slot*> slots;
+	std::vector<Slot*> freeSlots;
+	std::mutex poolMutex;
+};
+
+/* Borrows a scratch for the lifetime of a scope */
+class ScratchLease {
+public:
+	explicit ScratchLease(ScratchPool& pool) : pool(pool), scratch(pool.borrow()) {}
+	~ScratchLease() { pool.giveBack(scratch); }
+
+	PuzzleScratch *get() const { return scratch; }
+
+private:
+	ScratchLease(const ScratchLease&);
+	ScratchLease& operator=(const ScratchLease&);
+
+	ScratchPool& pool;
+	PuzzleScratch * const scratch;
+};
+
+#endif /* ! H_SCRATCHPOOL */